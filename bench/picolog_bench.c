@@ -0,0 +1,251 @@
+/**
+ * \file picolog_bench.c
+ *
+ * \brief benchmark firmware for picolog
+ *
+ * Not built by default: configure with -DPICOLOG_BENCHMARKS=ON and flash
+ * picolog_bench.uf2, or picolog_bench_deferred.uf2 for the same benchmarks
+ * with PICOLOG_DEFERRED.  Results are printed on stdio, which is the UART
+ * unless the targets are switched to USB with pico_enable_stdio_usb().
+ *
+ * Every cost is measured per call with SysTick counting clk_sys cycles, less
+ * the cost of the measurement itself, and reported as the minimum, average
+ * and maximum over ITERATIONS calls: the spread between minimum and maximum
+ * is the jitter a real-time loop has to budget for.  The tables are:
+ *
+ *   - formatting: newlib's vsnprintf against picolog_vsnprintf
+ *   - filtered out: a message below every subscriber's level, rejected
+ *     inline by the level macro or inside picolog_message()
+ *   - null subscriber: the full cost of picolog_message() with one text
+ *     subscriber that does nothing, across message sizes and argument counts
+ *     (in deferred mode this is the enqueue, and delivery is measured apart)
+ *   - throughput: messages per second and bytes per second through
+ *     picolog_format() to stdio, end to end
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/structs/systick.h"
+
+#include "picolog.h"
+
+#define ITERATIONS 1000
+#define THROUGHPUT_MESSAGES 200
+
+typedef int (*vformat_t)(char *buf, size_t size, const char *fmt, va_list ap);
+
+typedef struct {
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+  uint32_t count;
+} stats_t;
+
+static char s_buffer[PICOLOG_MAX_MESSAGE_LENGTH];
+static uint32_t s_overhead;    // cycles taken by an empty MEASURE()
+
+// SysTick counts clk_sys cycles down from 0xFFFFFF, so a call of up to about
+// 130 ms at 125 MHz can be timed without the count wrapping
+static void systick_init(void) {
+  systick_hw->rvr = 0x00FFFFFF;
+  systick_hw->cvr = 0;
+  systick_hw->csr = 0x5;    // enabled, clocked from the processor clock
+}
+
+static void stats_init(stats_t *stats) {
+  stats->min = UINT32_MAX;
+  stats->max = 0;
+  stats->total = 0;
+  stats->count = 0;
+}
+
+static void stats_add(stats_t *stats, uint32_t cycles) {
+  cycles = cycles > s_overhead ? cycles - s_overhead : 0;
+  if (cycles < stats->min) stats->min = cycles;
+  if (cycles > stats->max) stats->max = cycles;
+  stats->total += cycles;
+  stats->count++;
+}
+
+// time stmt once and add its cost to stats
+#define MEASURE(stats, stmt) do { \
+  uint32_t start_ = systick_hw->cvr; \
+  stmt; \
+  stats_add(&(stats), (start_ - systick_hw->cvr) & 0x00FFFFFF); \
+} while(0)
+
+// time stmt ITERATIONS times, running after (untimed) after each
+#define REPEAT(stats, stmt, after) do { \
+  int i_; \
+  stats_init(&(stats)); \
+  for (i_=0; i_<ITERATIONS; i_++) { \
+    MEASURE(stats, stmt); \
+    after; \
+  } \
+} while(0)
+
+static void print_header(const char *title) {
+  printf("\n%s, clk_sys cycles per call (%d calls)\n", title, ITERATIONS);
+  printf("%-14s %8s %8s %8s\n", "message", "min", "avg", "max");
+}
+
+static void print_row(const char *name, const stats_t *stats) {
+  printf("%-14s %8lu %8lu %8lu\n", name, (unsigned long)stats->min,
+         (unsigned long)(stats->total / stats->count), (unsigned long)stats->max);
+}
+
+static void calibrate(void) {
+  stats_t stats;
+  s_overhead = 0;
+  REPEAT(stats, , );
+  s_overhead = stats.min;
+}
+
+// -----------------------------------------------------------------------------
+// formatting
+
+static int call(vformat_t fn, const char *fmt, ...) {
+  va_list ap;
+  int n;
+  va_start(ap, fmt);
+  n = fn(s_buffer, sizeof(s_buffer), fmt, ap);
+  va_end(ap);
+  return n;
+}
+
+#define COMPARE(name, ...) do { \
+  stats_t newlib_, picolog_; \
+  REPEAT(newlib_, call(vsnprintf, __VA_ARGS__), ); \
+  REPEAT(picolog_, call(picolog_vsnprintf, __VA_ARGS__), ); \
+  printf("%-14s %10lu %10lu %7lu%%\n", name, \
+         (unsigned long)(newlib_.total / ITERATIONS), \
+         (unsigned long)(picolog_.total / ITERATIONS), \
+         (unsigned long)(picolog_.total * 100 / newlib_.total)); \
+} while(0)
+
+static void bench_format(void) {
+  printf("\nformatting, average clk_sys cycles per message (%d calls)\n", ITERATIONS);
+  printf("%-14s %10s %10s %8s\n", "message", "vsnprintf", "picolog", "ratio");
+  COMPARE("literal", "motor started");
+  COMPARE("int", "adc=%d", 2047);
+  COMPARE("ints", "x=%d y=%d z=%d t=%u", -12, 345, -6789, 4000000000u);
+  COMPARE("hex", "reg %08x = %#x", 0x40014000u, 0xbeefu);
+  COMPARE("int64", "uptime %llu us", 123456789012ULL);
+  COMPARE("string", "state %s -> %s", "IDLE", "RUNNING");
+  COMPARE("float", "temp %.2f C", 23.456);
+  COMPARE("mixed", "%s: %d bytes in %.3f ms (%u%%)", "rx", 1500, 1.25, 98u);
+}
+
+// -----------------------------------------------------------------------------
+// logging
+
+static void null_subscriber(picolog_level_t severity, char *msg) {
+  (void)severity;
+  (void)msg;
+}
+
+static void bench_filtered(void) {
+  stats_t stats;
+  volatile picolog_level_t level = PICOLOG_TRACE_LEVEL;
+
+  picolog_subscribe(null_subscriber, PICOLOG_ERROR_LEVEL);
+  print_header("filtered out");
+  REPEAT(stats, PICOLOG_TRACE("adc=%d", 2047), );
+  print_row("inline", &stats);
+  REPEAT(stats, PICOLOG(level, "adc=%d", 2047), );
+  print_row("in call", &stats);
+  picolog_unsubscribe(null_subscriber);
+}
+
+#define LOG_ROW(name, ...) do { \
+  REPEAT(stats, PICOLOG_INFO(__VA_ARGS__), PICOLOG_FLUSH()); \
+  print_row(name, &stats); \
+} while(0)
+
+#define FLUSH_ROW(name, ...) do { \
+  REPEAT(stats, PICOLOG_FLUSH(), PICOLOG_INFO(__VA_ARGS__)); \
+  print_row(name, &stats); \
+} while(0)
+
+#define MESSAGES(ROW) do { \
+  ROW("literal", "motor started"); \
+  ROW("1 int", "adc=%d", 2047); \
+  ROW("4 ints", "%d %d %d %d", 1, -22, 333, -4444); \
+  ROW("8 ints", "%d %d %d %d %d %d %d %d", 1, -22, 333, -4444, 5, -66, 777, -8888); \
+  ROW("string", "state %s", "RUNNING"); \
+  ROW("float", "temp %.2f C", 23.456); \
+  ROW("100 chars", "0123456789012345678901234567890123456789" \
+                   "0123456789012345678901234567890123456789" \
+                   "0123456789012345678"); \
+} while(0)
+
+static void bench_null_subscriber(void) {
+  stats_t stats;
+
+  picolog_subscribe(null_subscriber, PICOLOG_TRACE_LEVEL);
+  print_header("null subscriber");
+  MESSAGES(LOG_ROW);
+#ifdef PICOLOG_DEFERRED
+  PICOLOG_FLUSH();
+  PICOLOG_INFO("motor started");    // the first message for FLUSH_ROW
+  print_header("delivery by picolog_flush()");
+  MESSAGES(FLUSH_ROW);
+  PICOLOG_FLUSH();
+#endif
+  picolog_unsubscribe(null_subscriber);
+}
+
+#define THROUGHPUT_FMT "throughput %4d: the quick brown fox jumps over the lazy dog"
+
+static void bench_throughput(void) {
+  char line[PICOLOG_MAX_MESSAGE_LENGTH + 32];
+  uint64_t start, elapsed;
+  size_t bytes;
+  int i;
+
+  picolog_subscribe(picolog_format, PICOLOG_TRACE_LEVEL);
+  printf("\n");
+  start = time_us_64();
+  for (i=0; i<THROUGHPUT_MESSAGES; i++) {
+    PICOLOG_INFO(THROUGHPUT_FMT, i);
+    PICOLOG_FLUSH();
+  }
+  elapsed = time_us_64() - start;
+  picolog_unsubscribe(picolog_format);
+  // every line is the same length, colour codes included
+  snprintf(s_buffer, sizeof(s_buffer), THROUGHPUT_FMT, 0);
+  bytes = THROUGHPUT_MESSAGES * picolog_format_line(line, sizeof(line),
+                                                    PICOLOG_INFO_LEVEL, s_buffer);
+  printf("\nthroughput to stdio: %d messages, %lu bytes in %lu us: "
+         "%lu messages/s, %lu bytes/s\n",
+         THROUGHPUT_MESSAGES, (unsigned long)bytes, (unsigned long)elapsed,
+         (unsigned long)(THROUGHPUT_MESSAGES * 1000000ULL / elapsed),
+         (unsigned long)(bytes * 1000000ULL / elapsed));
+}
+
+int main(void) {
+  stdio_init_all();
+  sleep_ms(2000);    // give a USB host time to connect
+  systick_init();
+  calibrate();
+  picolog_init(PICOLOG_ALWAYS_LEVEL);
+  picolog_unsubscribe(picolog_format);
+  printf("picolog benchmarks (%s), clk_sys %lu Hz, measurement overhead %lu cycles\n",
+#ifdef PICOLOG_DEFERRED
+         "deferred",
+#else
+         "immediate",
+#endif
+         (unsigned long)clock_get_hz(clk_sys), (unsigned long)s_overhead);
+  bench_format();
+  bench_filtered();
+  bench_null_subscriber();
+  bench_throughput();
+  for (;;) {
+    tight_loop_contents();
+  }
+}
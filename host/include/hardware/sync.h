@@ -0,0 +1,60 @@
+/**
+ * \file hardware/sync.h
+ *
+ * \brief host build: spin locks, barriers and events on POSIX threads
+ *
+ * Spin locks are built on the compiler's atomic builtins so that
+ * ThreadSanitizer sees the ordering they provide.  There are no interrupts
+ * to disable, so the saved state is always 0.
+ */
+
+#ifndef PICOLOG_HOST_HARDWARE_SYNC_H_
+#define PICOLOG_HOST_HARDWARE_SYNC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sched.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef volatile uint32_t spin_lock_t;
+
+int spin_lock_claim_unused(bool required);
+spin_lock_t *spin_lock_instance(unsigned int lock_num);
+
+static inline uint32_t spin_lock_blocking(spin_lock_t *lock) {
+  while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+      sched_yield();    // the holder may be a thread that isn't running
+    }
+  }
+  return 0;
+}
+
+static inline void spin_unlock(spin_lock_t *lock, uint32_t saved_irq) {
+  (void)saved_irq;
+  __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline void __dmb(void) {
+#ifdef __SANITIZE_THREAD__
+  // ThreadSanitizer doesn't understand fences, but does understand this
+  static uint32_t barrier;
+  __atomic_fetch_add(&barrier, 0, __ATOMIC_SEQ_CST);
+#else
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+// __wfe() waits for the next __sev() or returns after a short timeout, as a
+// stand-in for the event flag that a __sev() sets on the RP2040
+void __sev(void);
+void __wfe(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOLOG_HOST_HARDWARE_SYNC_H_ */
@@ -0,0 +1,21 @@
+/**
+ * \file pico/multicore.h
+ *
+ * \brief host build: core1 is a thread
+ */
+
+#ifndef PICOLOG_HOST_PICO_MULTICORE_H_
+#define PICOLOG_HOST_PICO_MULTICORE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// run entry on a new thread, for which get_core_num() returns 1
+void multicore_launch_core1(void (*entry)(void));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOLOG_HOST_PICO_MULTICORE_H_ */
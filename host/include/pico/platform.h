@@ -0,0 +1,34 @@
+/**
+ * \file pico/platform.h
+ *
+ * \brief host build: the parts of the Pico SDK's pico/platform.h picolog uses
+ */
+
+#ifndef PICOLOG_HOST_PICO_PLATFORM_H_
+#define PICOLOG_HOST_PICO_PLATFORM_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NUM_CORES 2
+
+// the "core" of the calling thread: 1 for the thread started with
+// multicore_launch_core1(), 0 for every other
+unsigned int get_core_num(void);
+
+// threads are never interrupt handlers
+static inline unsigned int __get_current_exception(void) {
+  return 0;
+}
+
+static inline void tight_loop_contents(void) {
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOLOG_HOST_PICO_PLATFORM_H_ */
@@ -0,0 +1,20 @@
+/**
+ * \file pico/stdlib.h
+ *
+ * \brief host build: the parts of the Pico SDK's pico/stdlib.h picolog uses
+ */
+
+#ifndef PICOLOG_HOST_PICO_STDLIB_H_
+#define PICOLOG_HOST_PICO_STDLIB_H_
+
+#include <stdbool.h>
+
+#include "pico/time.h"
+#include "pico/platform.h"
+
+// stdio is the process's own
+static inline bool stdio_init_all(void) {
+  return true;
+}
+
+#endif /* PICOLOG_HOST_PICO_STDLIB_H_ */
@@ -0,0 +1,27 @@
+/**
+ * \file pico/time.h
+ *
+ * \brief host build: the parts of the Pico SDK's pico/time.h picolog uses
+ */
+
+#ifndef PICOLOG_HOST_PICO_TIME_H_
+#define PICOLOG_HOST_PICO_TIME_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// microseconds since the first call, from CLOCK_MONOTONIC
+uint64_t time_us_64(void);
+uint32_t time_us_32(void);
+void sleep_ms(uint32_t ms);
+void sleep_us(uint64_t us);
+void busy_wait_us_32(uint32_t us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOLOG_HOST_PICO_TIME_H_ */
@@ -0,0 +1,139 @@
+/**
+ * \file picolog_host.c
+ *
+ * \brief host build: POSIX stand-ins for the Pico SDK functions picolog uses
+ *
+ * Together with the headers in host/include this lets picolog be built and
+ * profiled on a workstation: time comes from CLOCK_MONOTONIC, spin locks are
+ * atomics, core1 is a thread and the event flag is a condition variable.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pico/time.h"
+#include "pico/platform.h"
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+
+#define SPIN_LOCK_COUNT 32
+
+static spin_lock_t s_spin_locks[SPIN_LOCK_COUNT];
+static unsigned int s_spin_locks_claimed;
+
+static _Thread_local unsigned int s_core_num;
+static void (*s_core1_entry)(void);
+
+static pthread_mutex_t s_event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_event_cond = PTHREAD_COND_INITIALIZER;
+static bool s_event;    // set by __sev(), cleared by __wfe()
+
+// =============================================================================
+// pico/time.h
+
+uint64_t time_us_64(void) {
+  static uint64_t start;    // so that times start near 0, as after a reset
+  struct timespec now;
+  uint64_t us;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  us = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+  if (__atomic_load_n(&start, __ATOMIC_RELAXED) == 0) {
+    uint64_t expected = 0;
+    __atomic_compare_exchange_n(&start, &expected, us - 1, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+  return us - __atomic_load_n(&start, __ATOMIC_RELAXED);
+}
+
+uint32_t time_us_32(void) {
+  return (uint32_t)time_us_64();
+}
+
+void sleep_us(uint64_t us) {
+  struct timespec delay;
+  delay.tv_sec = us / 1000000;
+  delay.tv_nsec = (long)(us % 1000000) * 1000;
+  nanosleep(&delay, NULL);
+}
+
+void sleep_ms(uint32_t ms) {
+  sleep_us((uint64_t)ms * 1000);
+}
+
+void busy_wait_us_32(uint32_t us) {
+  uint64_t end = time_us_64() + us;
+  while (time_us_64() < end) {
+  }
+}
+
+// =============================================================================
+// pico/platform.h and pico/multicore.h
+
+unsigned int get_core_num(void) {
+  return s_core_num;
+}
+
+static void *core1_thread(void *arg) {
+  (void)arg;
+  s_core_num = 1;
+  s_core1_entry();
+  return NULL;
+}
+
+void multicore_launch_core1(void (*entry)(void)) {
+  pthread_t thread;
+  s_core1_entry = entry;
+  if (pthread_create(&thread, NULL, core1_thread, NULL) != 0) {
+    perror("multicore_launch_core1");
+    exit(1);
+  }
+  pthread_detach(thread);
+}
+
+// =============================================================================
+// hardware/sync.h
+
+int spin_lock_claim_unused(bool required) {
+  unsigned int n = __atomic_fetch_add(&s_spin_locks_claimed, 1, __ATOMIC_RELAXED);
+  if (n >= SPIN_LOCK_COUNT) {
+    if (required) {
+      fprintf(stderr, "spin_lock_claim_unused: no spin locks left\n");
+      exit(1);
+    }
+    return -1;
+  }
+  return (int)n;
+}
+
+spin_lock_t *spin_lock_instance(unsigned int lock_num) {
+  return &s_spin_locks[lock_num];
+}
+
+void __sev(void) {
+  pthread_mutex_lock(&s_event_mutex);
+  s_event = true;
+  pthread_cond_broadcast(&s_event_cond);
+  pthread_mutex_unlock(&s_event_mutex);
+}
+
+void __wfe(void) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  pthread_mutex_lock(&s_event_mutex);
+  if (!s_event) {
+    pthread_cond_timedwait(&s_event_cond, &s_event_mutex, &deadline);
+  }
+  s_event = false;
+  pthread_mutex_unlock(&s_event_mutex);
+}
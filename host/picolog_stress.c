@@ -0,0 +1,225 @@
+/**
+ * \file picolog_stress.c
+ *
+ * \brief host build: multi-threaded stress test and microbenchmarks
+ *
+ *     picolog_stress [threads] [messages per thread]
+ *
+ * First times single-threaded calls of picolog in ns per call, then starts
+ * the given number of producer threads (4 by default), each logging a
+ * million messages (by default) as fast as it can while the main thread
+ * drains the queue.  Every message delivered is checked: the sequence
+ * numbers must rise, each producer's messages must arrive in order, and
+ * the messages delivered and lost must add up to those logged.  Exits with
+ * status 1 if any check fails.  Configure with -DPICOLOG_TSAN=ON to run it
+ * under ThreadSanitizer.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pico/time.h"
+#include "picolog.h"
+
+#ifndef PICOLOG_DEFERRED
+#error "the stress test needs PICOLOG_DEFERRED: immediate mode is not thread safe"
+#endif
+
+#define MAX_THREADS 64
+#define BENCH_CALLS 1000000
+#define BENCH_BATCH 25    // messages enqueued between flushes: fits the queue
+
+typedef struct {
+  int id;
+  int messages;
+  uint64_t elapsed_us;
+} producer_t;
+
+static int s_producers_running;
+
+// checked by verify(), from the drain thread only
+static uint32_t s_next_sequence;
+static int s_last[MAX_THREADS];
+static uint64_t s_delivered;
+static uint64_t s_reported;    // losses reported by "(N messages dropped)"
+static uint64_t s_errors;
+
+// -----------------------------------------------------------------------------
+// microbenchmarks
+
+static void null_subscriber(picolog_level_t severity, char *msg) {
+  (void)severity;
+  (void)msg;
+}
+
+static void null_binary_subscriber(picolog_level_t severity, const uint8_t *frame,
+                                   size_t length) {
+  (void)severity;
+  (void)frame;
+  (void)length;
+}
+
+static void print_row(const char *name, uint64_t elapsed_us, uint64_t calls) {
+  printf("%-32s %8.1f ns/call %12.0f calls/s\n", name,
+         elapsed_us * 1000.0 / calls, calls * 1e6 / (elapsed_us ? elapsed_us : 1));
+}
+
+static void bench(void) {
+  uint64_t start, elapsed;
+  int i, j;
+
+  printf("single thread, %d calls each\n", BENCH_CALLS);
+
+  picolog_subscribe(null_subscriber, PICOLOG_ERROR_LEVEL);
+  start = time_us_64();
+  for (i=0; i<BENCH_CALLS; i++) {
+    PICOLOG_TRACE("x=%d", i);
+  }
+  print_row("filtered out (inline)", time_us_64() - start, BENCH_CALLS);
+
+  picolog_subscribe(null_subscriber, PICOLOG_TRACE_LEVEL);
+  elapsed = 0;
+  for (i=0; i<BENCH_CALLS; i+=BENCH_BATCH) {
+    start = time_us_64();
+    for (j=0; j<BENCH_BATCH; j++) {
+      PICOLOG_INFO("x=%d y=%s", i + j, "abc");
+    }
+    elapsed += time_us_64() - start;
+    PICOLOG_FLUSH();
+  }
+  print_row("enqueue \"x=%d y=%s\"", elapsed, BENCH_CALLS);
+
+  start = time_us_64();
+  for (i=0; i<BENCH_CALLS; i++) {
+    PICOLOG_INFO("x=%d y=%s", i, "abc");
+    PICOLOG_FLUSH();
+  }
+  print_row("enqueue + deliver as text", time_us_64() - start, BENCH_CALLS);
+  picolog_unsubscribe(null_subscriber);
+
+  picolog_subscribe_binary(null_binary_subscriber, PICOLOG_TRACE_LEVEL);
+  start = time_us_64();
+  for (i=0; i<BENCH_CALLS; i++) {
+    PICOLOG_INFO("x=%d y=%s", i, "abc");
+    PICOLOG_FLUSH();
+  }
+  print_row("enqueue + deliver as frame", time_us_64() - start, BENCH_CALLS);
+  picolog_unsubscribe_binary(null_binary_subscriber);
+}
+
+// -----------------------------------------------------------------------------
+// stress test
+
+static void verify(const picolog_record_t *record) {
+  int id, n;
+
+  if (record->sequence < s_next_sequence) {
+    s_errors++;
+  }
+  s_next_sequence = record->sequence + 1;
+  if (record->severity == PICOLOG_WARNING_LEVEL) {
+    unsigned long lost;
+    if (sscanf(record->text, "(%lu messages dropped)", &lost) == 1) {
+      s_reported += lost;
+      return;
+    }
+  }
+  if (record->args_length != 2 * sizeof(int)) {
+    s_errors++;
+    return;
+  }
+  memcpy(&id, record->args, sizeof(id));
+  memcpy(&n, record->args + sizeof(id), sizeof(n));
+  if (id < 0 || id >= MAX_THREADS || n <= s_last[id]) {
+    s_errors++;
+    return;
+  }
+  s_last[id] = n;
+  s_delivered++;
+}
+
+static void *producer(void *arg) {
+  producer_t *p = arg;
+  uint64_t start = time_us_64();
+  int i;
+  for (i=0; i<p->messages; i++) {
+    PICOLOG_INFO("producer %d message %d", p->id, i);
+  }
+  p->elapsed_us = time_us_64() - start;
+  __atomic_fetch_sub(&s_producers_running, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static int stress(int threads, int messages) {
+  static producer_t producers[MAX_THREADS];
+  static pthread_t ids[MAX_THREADS];
+  uint64_t start, elapsed, logged = (uint64_t)threads * messages;
+  uint64_t producer_us = 0;
+  uint32_t overruns = picolog_overruns();
+  int i;
+
+  printf("\n%d threads, %d messages each\n", threads, messages);
+  for (i=0; i<MAX_THREADS; i++) {
+    s_last[i] = -1;
+  }
+  s_next_sequence = 0;
+  picolog_subscribe_record(verify, PICOLOG_TRACE_LEVEL);
+  s_producers_running = threads;
+  start = time_us_64();
+  for (i=0; i<threads; i++) {
+    producers[i].id = i;
+    producers[i].messages = messages;
+    if (pthread_create(&ids[i], NULL, producer, &producers[i]) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+  while (__atomic_load_n(&s_producers_running, __ATOMIC_ACQUIRE) > 0) {
+    PICOLOG_FLUSH();
+  }
+  for (i=0; i<threads; i++) {
+    pthread_join(ids[i], NULL);
+    producer_us += producers[i].elapsed_us;
+  }
+  PICOLOG_FLUSH();
+  elapsed = time_us_64() - start;
+  picolog_unsubscribe_record(verify);
+  overruns = picolog_overruns() - overruns;
+
+  printf("%-32s %8.1f ns/call\n", "producer cost", producer_us * 1000.0 / logged);
+  printf("%-32s %12.0f messages/s\n", "logged", logged * 1e6 / elapsed);
+  printf("%-32s %12.0f messages/s (%llu delivered, %lu lost)\n", "delivered",
+         s_delivered * 1e6 / elapsed, (unsigned long long)s_delivered,
+         (unsigned long)overruns);
+  if (s_delivered + overruns != logged || s_reported != overruns) {
+    printf("FAIL: %llu logged, %llu delivered, %lu lost, %llu reported lost\n",
+           (unsigned long long)logged, (unsigned long long)s_delivered,
+           (unsigned long)overruns, (unsigned long long)s_reported);
+    return 1;
+  }
+  if (s_errors > 0) {
+    printf("FAIL: %llu messages out of order or corrupt\n", (unsigned long long)s_errors);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+  int messages = argc > 2 ? atoi(argv[2]) : 1000000;
+
+  if (threads < 1 || threads > MAX_THREADS || messages < 1) {
+    fprintf(stderr, "usage: %s [threads (1-%d)] [messages per thread]\n", argv[0],
+            MAX_THREADS);
+    return 2;
+  }
+  picolog_init(PICOLOG_ALWAYS_LEVEL);
+  picolog_unsubscribe(picolog_format);
+  bench();
+  return stress(threads, messages);
+}
@@ -36,39 +36,1032 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 
+#include "pico/time.h"
+#include "pico/platform.h"
+#include "hardware/sync.h"
+
+#ifdef PICOLOG_DRAIN_CORE1
+#include "pico/multicore.h"
+#endif
 
 // =============================================================================
 // types and definitions
 
+// subscriber functions are stored as a generic function pointer and cast
+// back to the type given by `kind` before they are called.
+typedef void (*subscriber_fn_t)(void);
+
+// kinds are single bits so that wanted() can test for several at once
+typedef enum {
+  SUBSCRIBER_TEXT = 0x01,      // picolog_function_t
+  SUBSCRIBER_TIMED = 0x02,     // picolog_timed_function_t
+  SUBSCRIBER_BINARY = 0x04,    // picolog_binary_function_t
+  SUBSCRIBER_RECORD = 0x08,    // picolog_record_function_t
+  SUBSCRIBER_BATCH = 0x10,     // picolog_batch_function_t
+  SUBSCRIBER_RECORD_ARGS = 0x40,    // picolog_record_function_t, without text
+  SUBSCRIBER_BATCH_TEXT = 0x80,     // picolog_batch_function_t, with text
+} subscriber_kind_t;
+
+// in a route's kinds, in place of its own kind: a subscriber that takes its
+// messages through a queue of its own, and so needs neither text nor frame
+// at the time
+#define SUBSCRIBER_QUEUED 0x20
+
+// the kinds that need the formatted text, and the packed arguments, and
+// the two kinds of batch subscriber
+#define SUBSCRIBERS_WITH_TEXT \
+  (SUBSCRIBER_TEXT | SUBSCRIBER_TIMED | SUBSCRIBER_RECORD | SUBSCRIBER_BATCH_TEXT)
+#define SUBSCRIBERS_WITH_ARGS \
+  (SUBSCRIBER_BINARY | SUBSCRIBER_RECORD | SUBSCRIBER_RECORD_ARGS | SUBSCRIBERS_BATCH)
+#define SUBSCRIBERS_BATCH (SUBSCRIBER_BATCH | SUBSCRIBER_BATCH_TEXT)
+#define SUBSCRIBERS_ANY (SUBSCRIBERS_WITH_TEXT | SUBSCRIBERS_WITH_ARGS | SUBSCRIBER_QUEUED)
+
 typedef struct {
-  picolog_function_t fn;
-  picolog_level_t threshold;
+  subscriber_fn_t fn;
+  subscriber_kind_t kind;
+  picolog_levels_t levels;
+  const picolog_channel_t *channel;    // the only channel taken, or NULL for all
+  uint8_t slot;    // index in s_subscribers, for its counters
+  int8_t queue;    // index in s_subscriber_queues, or NO_QUEUE
 } subscriber_t;
 
+#define NO_QUEUE (-1)
+
+#define NO_SUBSCRIBERS_LEVEL ((picolog_level_t)(PICOLOG_ALWAYS_LEVEL + 1))
+#define LEVEL_COUNT (PICOLOG_ALWAYS_LEVEL - PICOLOG_TRACE_LEVEL + 1)
+// the route after the per-level ones, which lists every batch subscriber
+#define BATCH_ROUTE LEVEL_COUNT
+
+// the subscribers that take messages of one level, so that dispatch() walks
+// only those.  Entries are copies of s_subscribers rather than indices into
+// it, so a slot being reused can't change a route that is being walked.
+typedef struct {
+  uint8_t kinds;    // every kind in the list, for wanted()
+  uint8_t count;
+  subscriber_t subscribers[PICOLOG_MAX_SUBSCRIBERS];
+} route_t;
+
+// all message formatting goes through these, so that PICOLOG_BUILTIN_PRINTF
+// can swap newlib's implementation for picolog's own
+#ifdef PICOLOG_BUILTIN_PRINTF
+#define SNPRINTF picolog_snprintf
+#define VSNPRINTF picolog_vsnprintf
+#else
+#define SNPRINTF snprintf
+#define VSNPRINTF vsnprintf
+#endif
+
+// how a printf conversion consumes (and stores) its argument
+typedef enum {
+  ARG_NONE,      // %% or an unrecognised conversion: no argument
+  ARG_IGNORE,    // %n: the pointer is consumed but not stored
+  ARG_INT,
+  ARG_LONG,
+  ARG_LLONG,
+  ARG_DOUBLE,
+  ARG_LDOUBLE,
+  ARG_POINTER,
+  ARG_STRING,
+} arg_class_t;
+
+// one parsed conversion specification, e.g. "%-*.3lx"
+typedef struct {
+  const char *start;     // the '%'
+  const char *modifier;  // first character of the length modifier (if any)
+  const char *end;       // one past the conversion character
+  char conversion;
+  int stars;             // number of '*' width/precision arguments
+  int shorts;            // number of 'h' length modifiers
+  arg_class_t arg;
+} conversion_t;
+
+// a message with its arguments packed by pack_args().  `sequence` counts
+// every message logged, including those dropped because the deferred queue
+// was full, so gaps reveal overruns.
+typedef struct {
+  uint32_t sequence;
+  picolog_level_t severity;
+  const picolog_channel_t *channel;
+  const char *fmt;
+  uint64_t timestamp;
+  uint8_t core;
+  bool structured;    // args are fields packed by pack_fields()
+  uint16_t args_length;
+  uint8_t args[PICOLOG_MAX_ARGS_LENGTH];
+} record_t;
+
+// the queue of a subscriber that picolog_subscriber_queued() has given one.
+// The drain copies each record the subscriber takes into it, and
+// picolog_flush_queued() delivers them, so that a slow subscriber holds up
+// neither the drain nor the other subscribers: when it falls behind, its
+// queue fills and it alone loses messages.  head and the drop counts are
+// written only by the drain, tail only by picolog_flush_queued().
+typedef struct {
+  subscriber_t subscriber;    // fn is NULL if the queue is free
+  uint32_t head;              // next record to be written
+  uint32_t tail;              // next record to be delivered
+  uint32_t dropped;           // records lost to a full queue
+  uint32_t reported;          // ...of which the subscriber has been told
+  uint32_t first_lost;        // sequence number of the first not yet reported
+  record_t records[PICOLOG_SUBSCRIBER_QUEUE_LENGTH];
+} subscriber_queue_t;
+
+// a message as stored in the deferred queue: a header and just the packed
+// arguments it has, padded to a multiple of the header's alignment (a word
+// on the RP2040), so a short message takes a fraction of the space of a
+// long one.  Entries are laid end to end in a ring of bytes; one with a NULL
+// fmt is padding, filling the end of the ring when the next entry would not
+// fit before it, and an end too short for even a padding header is skipped
+// by convention.
+//
+// `turn` implements the handshake between producers and the drain: an
+// entry at queue position pos (a byte count that runs freely) holds a
+// complete message once turn == pos + 1.  The timestamp is split in two so
+// that entries need no more than word alignment.
+typedef struct {
+  uint32_t turn;          // only accessed through TURN_LOAD() and TURN_STORE()
+  uint16_t size;          // of the whole entry, padding included
+  uint16_t args_length;
+  uint32_t sequence;
+  uint32_t timestamp[2];  // low word first
+  const picolog_channel_t *channel;
+  const char *fmt;
+  uint8_t severity;
+  uint8_t core;
+  uint8_t structured;
+  uint8_t args[];
+} entry_t;
+
+// the size of an entry_t holding length bytes of arguments
+#define ENTRY_SIZE(length) \
+  ((offsetof(entry_t, args) + (length) + _Alignof(entry_t) - 1) & ~(_Alignof(entry_t) - 1))
+
+// the turn handshake needs acquire and release ordering.  On the Cortex-M0+
+// GCC's atomic builtins compile to the plain access and __dmb() it would
+// otherwise be written with, and in a host build they also tell
+// ThreadSanitizer what is going on.
+#define TURN_LOAD(entry) __atomic_load_n(&(entry)->turn, __ATOMIC_ACQUIRE)
+#define TURN_STORE(entry, value) __atomic_store_n(&(entry)->turn, (value), __ATOMIC_RELEASE)
+
+// the rate limiter's state for one call site, identified by its fmt
+typedef struct {
+  const char *fmt;
+  uint64_t due;           // when it next earns a message, in time_us_64() terms
+  uint32_t suppressed;    // messages suppressed since the last one logged
+  const picolog_channel_t *channel;    // ...and the channel and level of the
+  picolog_level_t severity;            // last of them, for the report
+} site_t;
+
+// the space to format one message and encode its frame in
+typedef struct {
+  char message[PICOLOG_MAX_MESSAGE_LENGTH];
+  uint8_t frame[PICOLOG_MAX_FRAME_LENGTH];
+} scratch_t;
+
+// state of the COBS encoder used to frame binary messages
+typedef struct {
+  uint8_t *frame;
+  size_t length;    // bytes written so far
+  size_t code;      // offset of the current block's code byte
+  uint8_t count;    // value of that code byte: block length + 1
+} cobs_t;
+
 // =============================================================================
 // local storage
 
 static subscriber_t s_subscribers[PICOLOG_MAX_SUBSCRIBERS];
-static char s_message[PICOLOG_MAX_MESSAGE_LENGTH];
+// routes are rebuilt from s_subscribers whenever it changes.  There are two
+// sets so that the drain, which may be walking one on the other core, always
+// sees a complete set: the new one is built aside and then switched in.
+static route_t s_routes[2][LEVEL_COUNT + 1];
+static uint8_t s_route_set;    // the set in use
+// scratch space for each core and each level of nesting on it: a message
+// logged by an interrupt handler that has interrupted another, or by a
+// subscriber, takes the next one up.  Code on one core nests strictly, so a
+// count per core is enough to keep track of them without a lock.
+static scratch_t s_scratch[NUM_CORES][PICOLOG_SCRATCH_DEPTH];
+static volatile uint8_t s_depth[NUM_CORES];    // scratch_t's in use
+static uint32_t s_sequence;    // sequence number of the next message
+static picolog_channel_t *s_channels;    // registered channels, newest first
+static uint32_t s_random = 2463534242u;    // picolog_random()'s state, never 0
+static volatile uint32_t s_trigger_until;    // end of the trigger window, in time_us_32()
+
+// the lowest threshold of any subscriber, above every level if there are none
+volatile picolog_level_t picolog_min_threshold = NO_SUBSCRIBERS_LEVEL;
+// set by picolog_trigger(), cleared once the window is found to have closed
+volatile bool picolog_trigger_armed;
+
+#ifdef PICOLOG_DEFERRED
+_Static_assert((PICOLOG_QUEUE_SIZE & (PICOLOG_QUEUE_SIZE - 1)) == 0,
+               "PICOLOG_QUEUE_SIZE must be a power of two");
+_Static_assert(PICOLOG_QUEUE_SIZE >= 2 * ENTRY_SIZE(PICOLOG_MAX_ARGS_LENGTH),
+               "PICOLOG_QUEUE_SIZE is too small for PICOLOG_MAX_ARGS_LENGTH");
+
+static _Alignas(entry_t) uint8_t s_queue[PICOLOG_QUEUE_SIZE];
+static spin_lock_t *s_queue_lock;       // guards the fields below
+static uint32_t s_queue_head;           // next position to be written
+static bool s_draining;                 // true while picolog_flush() runs
+static uint32_t s_overruns;             // messages lost to a full queue
+static uint32_t s_dropped[LEVEL_COUNT]; // ...and by level
+static uint32_t s_queue_tail;           // next position to be read
+static uint32_t s_expected;             // next sequence number due (drain only)
+static const char s_dropped_fmt[] = "(%lu messages dropped)";
+// messages collected by the drain for batch subscribers, with their own
+// copies of the arguments and text
+static picolog_record_t s_batch[PICOLOG_BATCH_LENGTH];
+static uint8_t s_batch_args[PICOLOG_BATCH_LENGTH][PICOLOG_MAX_ARGS_LENGTH];
+static char s_batch_text[PICOLOG_BATCH_TEXT_SIZE];
+static size_t s_batch_count;
+static size_t s_batch_text_used;
+_Static_assert(PICOLOG_BATCH_TEXT_SIZE >= PICOLOG_MAX_MESSAGE_LENGTH,
+               "PICOLOG_BATCH_TEXT_SIZE must hold at least one message");
+static subscriber_queue_t s_subscriber_queues[PICOLOG_SUBSCRIBER_QUEUES];
+_Static_assert((PICOLOG_SUBSCRIBER_QUEUE_LENGTH & (PICOLOG_SUBSCRIBER_QUEUE_LENGTH - 1)) == 0,
+               "PICOLOG_SUBSCRIBER_QUEUE_LENGTH must be a power of two");
+#endif
+
+#ifdef PICOLOG_DRAIN_CORE1
+static bool s_drain_launched;
+#endif
+
+#ifdef PICOLOG_STATS
+static picolog_stats_t s_stats;
+// add n to one of s_stats.  Any core may be counting at once, and the M0+
+// has no atomic read-modify-write, so this is a relaxed load and store: an
+// update that races with another on the other core may be lost.
+#define STAT_ADD(counter, n) \
+  __atomic_store_n(&s_stats.counter, \
+                   __atomic_load_n(&s_stats.counter, __ATOMIC_RELAXED) + (n), \
+                   __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#endif
+
+#ifdef PICOLOG_RATE_LIMIT
+static site_t s_sites[PICOLOG_RATE_LIMIT_SITES];
+static uint32_t s_suppressed;    // messages suppressed by the rate limiter
+// how far ahead of now a site's due time may be for it to log: the burst
+#define RATE_LIMIT_SLACK \
+  ((PICOLOG_RATE_LIMIT_BURST - 1) * (uint64_t)PICOLOG_RATE_LIMIT_INTERVAL_US)
+// fmt of the report of suppressed messages, which is never itself limited
+static const char s_suppressed_fmt[] = "(suppressed %lu more like \"%s\")";
+#endif
+
+// =============================================================================
+// forward declarations
+
+static picolog_err_t subscribe(subscriber_kind_t kind, subscriber_fn_t fn,
+                               picolog_levels_t levels);
+static picolog_err_t unsubscribe(subscriber_fn_t fn);
+static void update_routes(void);
+static const route_t *route(picolog_level_t severity);
+static int level_index(picolog_level_t severity);
+static bool wanted(int kinds, picolog_level_t severity);
+static void log_message(const picolog_channel_t *channel, picolog_level_t severity,
+                        const char *fmt, va_list ap);
+static scratch_t *scratch_claim(void);
+static void scratch_release(void);
+static void dispatch(const record_t *record, scratch_t *scratch, size_t text_length);
+static void make_view(picolog_record_t *view, const record_t *record, char *text,
+                      size_t text_length);
+static void call_subscriber(const subscriber_t *s, const picolog_record_t *view,
+                            scratch_t *scratch, size_t *frame_length);
+static size_t encode_frame(uint8_t *frame, const picolog_record_t *record);
+static void log_packed(const picolog_channel_t *channel, picolog_level_t severity,
+                       const char *fmt, bool structured, const uint8_t *args,
+                       size_t args_length);
+static size_t pack_args(uint8_t *args, const char *fmt, va_list ap);
+static size_t pack_fields(uint8_t *args, const picolog_field_t *fields, size_t count);
+static bool get_field(const uint8_t *args, size_t args_length, size_t *offset,
+                      picolog_field_t *field);
+static size_t render_text(char *msg, size_t length, const record_t *record);
+static void trigger_at(uint32_t now, uint32_t duration_us);
+#ifdef PICOLOG_RATE_LIMIT
+static bool rate_limit(const picolog_channel_t *channel, picolog_level_t severity,
+                       const char *fmt);
+static void report_suppressed(void);
+#endif
+
+#ifdef PICOLOG_DEFERRED
+static void queue_init(void);
+static entry_t *entry_at(uint32_t position);
+static entry_t *claim_entry(picolog_level_t severity, size_t size, uint32_t *save,
+                            uint32_t *position);
+static entry_t *oldest_entry(void);
+static void deliver(const record_t *record);
+static void report_dropped(uint32_t sequence, uint32_t count);
+static void make_dropped(record_t *record, uint32_t sequence, uint32_t count);
+static picolog_err_t queue_attach(subscriber_t *s);
+static bool queue_detach(subscriber_t *s);
+static void queue_record(const subscriber_t *s, const record_t *record);
+static void deliver_queued(const subscriber_t *s, const record_t *record);
+static void batch_add(const picolog_record_t *record);
+static void batch_flush(void);
+#ifdef PICOLOG_DRAIN_CORE1
+static void drain_core1(void);
+#endif
+#endif
 
 // =============================================================================
 // user-visible code
 
 void picolog_init(picolog_level_t threshold) {
+#ifndef PICOLOG_NO_ANSI
   printf("\x1b[2J");
+#endif
   memset(s_subscribers, 0, sizeof(s_subscribers));
+#ifdef PICOLOG_STATS
+  memset(&s_stats, 0, sizeof(s_stats));
+#endif
+  update_routes();
+#ifdef PICOLOG_DEFERRED
+  queue_init();
+#endif
   picolog_subscribe(picolog_format, threshold);
+#ifdef PICOLOG_DRAIN_CORE1
+  if (!s_drain_launched) {
+    multicore_launch_core1(drain_core1);
+    s_drain_launched = true;
+  }
+#endif
 }
 
-// search the s_subscribers table to install or update fn
 picolog_err_t picolog_subscribe(picolog_function_t fn, picolog_level_t threshold) {
+  return subscribe(SUBSCRIBER_TEXT, (subscriber_fn_t)fn,
+                   PICOLOG_LEVELS_FROM(threshold));
+}
+
+// like picolog_subscribe(), but fn receives the levels in the set levels
+// (e.g. PICOLOG_LEVEL_BIT(PICOLOG_TRACE_LEVEL) | PICOLOG_LEVEL_BIT(...)) rather
+// than every level from a threshold up.  The same goes for the _mask
+// variants of the other kinds of subscriber.
+picolog_err_t picolog_subscribe_mask(picolog_function_t fn, picolog_levels_t levels) {
+  return subscribe(SUBSCRIBER_TEXT, (subscriber_fn_t)fn, levels);
+}
+
+picolog_err_t picolog_unsubscribe(picolog_function_t fn) {
+  return unsubscribe((subscriber_fn_t)fn);
+}
+
+// timed subscribers also receive the time at which the message was logged
+picolog_err_t picolog_subscribe_timed(picolog_timed_function_t fn,
+                                      picolog_level_t threshold) {
+  return subscribe(SUBSCRIBER_TIMED, (subscriber_fn_t)fn,
+                   PICOLOG_LEVELS_FROM(threshold));
+}
+
+picolog_err_t picolog_subscribe_timed_mask(picolog_timed_function_t fn,
+                                           picolog_levels_t levels) {
+  return subscribe(SUBSCRIBER_TIMED, (subscriber_fn_t)fn, levels);
+}
+
+picolog_err_t picolog_unsubscribe_timed(picolog_timed_function_t fn) {
+  return unsubscribe((subscriber_fn_t)fn);
+}
+
+// record subscribers receive a picolog_record_t: a read-only view of the
+// message and its text, which is valid until the subscriber returns.
+picolog_err_t picolog_subscribe_record(picolog_record_function_t fn,
+                                       picolog_level_t threshold) {
+  return subscribe(SUBSCRIBER_RECORD, (subscriber_fn_t)fn,
+                   PICOLOG_LEVELS_FROM(threshold));
+}
+
+picolog_err_t picolog_subscribe_record_mask(picolog_record_function_t fn,
+                                            picolog_levels_t levels) {
+  return subscribe(SUBSCRIBER_RECORD, (subscriber_fn_t)fn, levels);
+}
+
+picolog_err_t picolog_unsubscribe_record(picolog_record_function_t fn) {
+  return unsubscribe((subscriber_fn_t)fn);
+}
+
+// like picolog_subscribe_record(), but for a subscriber that only reads the
+// packed arguments: a message that nobody else wants as text is never
+// formatted, and its record's text is then empty.  Unsubscribe it with
+// picolog_unsubscribe_record().
+picolog_err_t picolog_subscribe_record_args(picolog_record_function_t fn,
+                                            picolog_level_t threshold) {
+  return subscribe(SUBSCRIBER_RECORD_ARGS, (subscriber_fn_t)fn,
+                   PICOLOG_LEVELS_FROM(threshold));
+}
+
+picolog_err_t picolog_subscribe_record_args_mask(picolog_record_function_t fn,
+                                                 picolog_levels_t levels) {
+  return subscribe(SUBSCRIBER_RECORD_ARGS, (subscriber_fn_t)fn, levels);
+}
+
+// binary subscribers receive each message as an encoded frame (see
+// PICOLOG_MAX_FRAME_LENGTH) rather than as formatted text.
+picolog_err_t picolog_subscribe_binary(picolog_binary_function_t fn,
+                                       picolog_level_t threshold) {
+  return subscribe(SUBSCRIBER_BINARY, (subscriber_fn_t)fn,
+                   PICOLOG_LEVELS_FROM(threshold));
+}
+
+picolog_err_t picolog_subscribe_binary_mask(picolog_binary_function_t fn,
+                                            picolog_levels_t levels) {
+  return subscribe(SUBSCRIBER_BINARY, (subscriber_fn_t)fn, levels);
+}
+
+picolog_err_t picolog_unsubscribe_binary(picolog_binary_function_t fn) {
+  return unsubscribe((subscriber_fn_t)fn);
+}
+
+// batch subscribers receive an array of records at a time: in deferred mode
+// everything the drain delivers in one picolog_flush(), up to
+// PICOLOG_BATCH_LENGTH messages or PICOLOG_BATCH_TEXT_SIZE bytes of text per
+// call, and in immediate mode each message as a batch of one.  A subscriber
+// whose levels or channel leave gaps in a batch gets the runs between them
+// in separate calls.  Like picolog_subscribe_record_args(), a batch
+// subscriber doesn't have messages formatted for it, so its records' text
+// may be empty: one subscribed with picolog_subscribe_batch_text() gets the
+// text too.
+picolog_err_t picolog_subscribe_batch(picolog_batch_function_t fn,
+                                      picolog_level_t threshold) {
+  return subscribe(SUBSCRIBER_BATCH, (subscriber_fn_t)fn,
+                   PICOLOG_LEVELS_FROM(threshold));
+}
+
+picolog_err_t picolog_subscribe_batch_mask(picolog_batch_function_t fn,
+                                           picolog_levels_t levels) {
+  return subscribe(SUBSCRIBER_BATCH, (subscriber_fn_t)fn, levels);
+}
+
+picolog_err_t picolog_unsubscribe_batch(picolog_batch_function_t fn) {
+  return unsubscribe((subscriber_fn_t)fn);
+}
+
+picolog_err_t picolog_subscribe_batch_text(picolog_batch_function_t fn,
+                                           picolog_level_t threshold) {
+  return subscribe(SUBSCRIBER_BATCH_TEXT, (subscriber_fn_t)fn,
+                   PICOLOG_LEVELS_FROM(threshold));
+}
+
+picolog_err_t picolog_subscribe_batch_text_mask(picolog_batch_function_t fn,
+                                                picolog_levels_t levels) {
+  return subscribe(SUBSCRIBER_BATCH_TEXT, (subscriber_fn_t)fn, levels);
+}
+
+// limit fn, a subscriber of any kind, to the messages logged to channel, or
+// with channel NULL let it take every message again.
+picolog_err_t picolog_subscriber_channel(picolog_any_function_t fn,
+                                         const picolog_channel_t *channel) {
+  int i;
+  for (i=0; i<PICOLOG_MAX_SUBSCRIBERS; i++) {
+    if (s_subscribers[i].fn == (subscriber_fn_t)fn) {
+      s_subscribers[i].channel = channel;
+      update_routes();
+      return PICOLOG_ERR_NONE;
+    }
+  }
+  return PICOLOG_ERR_NOT_SUBSCRIBED;
+}
+
+// change the levels fn takes, whatever kind of subscriber it is, without
+// subscribing it again.  The routes the level macros and the drain use are
+// rebuilt aside and switched in with one store, so a message is always
+// routed by either the old levels or the new ones.
+picolog_err_t picolog_subscriber_levels(picolog_any_function_t fn,
+                                        picolog_levels_t levels) {
+  int i;
+  for (i=0; i<PICOLOG_MAX_SUBSCRIBERS; i++) {
+    if (s_subscribers[i].fn == (subscriber_fn_t)fn) {
+      s_subscribers[i].levels = levels;
+      update_routes();
+      return PICOLOG_ERR_NONE;
+    }
+  }
+  return PICOLOG_ERR_NOT_SUBSCRIBED;
+}
+
+// like picolog_subscriber_levels(), for threshold and every level above it
+picolog_err_t picolog_subscriber_threshold(picolog_any_function_t fn,
+                                           picolog_level_t threshold) {
+  return picolog_subscriber_levels(fn, PICOLOG_LEVELS_FROM(threshold));
+}
+
+// add channel to the channels that picolog_find_channel() searches.  Like
+// subscribing, this must not happen from more than one place at a time.
+void picolog_register_channel(picolog_channel_t *channel) {
+  picolog_channel_t *c;
+  for (c=s_channels; c!=NULL; c=c->next) {
+    if (c == channel) {
+      return;    // already registered
+    }
+  }
+  channel->next = s_channels;
+  s_channels = channel;
+}
+
+// the registered channel called name, or NULL if there is none
+picolog_channel_t *picolog_find_channel(const char *name) {
+  picolog_channel_t *c;
+  for (c=s_channels; c!=NULL; c=c->next) {
+    if (strcmp(c->name, name) == 0) {
+      return c;
+    }
+  }
+  return NULL;
+}
+
+// the most recently registered channel, whose next leads to the others
+picolog_channel_t *picolog_channels(void) {
+  return s_channels;
+}
+
+// give the deferred subscriber fn a queue of its own, if queued is true, or
+// take it away.  Its messages are then delivered by picolog_flush_queued()
+// rather than picolog_flush(), so it may be as slow as it likes without
+// holding up the other subscribers: while it falls behind, its queue fills
+// and the messages it misses are counted by picolog_queued_dropped() and
+// reported to it later like those lost by the main queue.  Messages still
+// in the queue when it is taken away are lost.  In immediate mode there is
+// no drain to hand the work to and this has no effect.  Batch subscribers,
+// which already take their messages in few calls, can't be queued.
+picolog_err_t picolog_subscriber_queued(picolog_any_function_t fn, bool queued) {
+  int i;
+  for (i=0; i<PICOLOG_MAX_SUBSCRIBERS; i++) {
+    if (s_subscribers[i].fn == (subscriber_fn_t)fn) {
+      if (s_subscribers[i].kind & SUBSCRIBERS_BATCH) {
+        return PICOLOG_ERR_INVALID_ARGUMENT;
+      }
+#ifdef PICOLOG_DEFERRED
+      if (queued) {
+        return queue_attach(&s_subscribers[i]);
+      }
+      if (queue_detach(&s_subscribers[i])) {
+        update_routes();
+      }
+#else
+      (void)queued;
+#endif
+      return PICOLOG_ERR_NONE;
+    }
+  }
+  return PICOLOG_ERR_NOT_SUBSCRIBED;
+}
+
+void picolog_message(picolog_level_t severity, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  log_message(NULL, severity, fmt, ap);
+  va_end(ap);
+}
+
+// log to channel: the message is dropped if it is below the channel's
+// threshold, and tagged with the channel if not.
+void picolog_channel_message(const picolog_channel_t *channel,
+                             picolog_level_t severity, const char *fmt, ...) {
+  va_list ap;
+  if (severity < channel->threshold) {
+    STAT_ADD(filtered, 1);
+    return;
+  }
+  va_start(ap, fmt);
+  log_message(channel, severity, fmt, ap);
+  va_end(ap);
+}
+
+// log a structured message: event, which like fmt must be a string that
+// lives for the lifetime of the program, and count typed fields.  The
+// fields are stored as they are, not formatted, and only rendered as text
+// ("event key=value ...") for subscribers that take text.
+void picolog_kv(picolog_level_t severity, const char *event,
+                const picolog_field_t *fields, size_t count) {
+  uint8_t args[PICOLOG_MAX_ARGS_LENGTH];
+  if (severity < picolog_min_threshold || !wanted(SUBSCRIBERS_ANY, severity)) {
+    STAT_ADD(filtered, 1);
+    return;
+  }
+#ifdef PICOLOG_RATE_LIMIT
+  if (!rate_limit(NULL, severity, event)) {
+    return;
+  }
+#endif
+  log_packed(NULL, severity, event, true, args, pack_fields(args, fields, count));
+}
+
+// log a message whose arguments have already been packed the way
+// picolog_message() packs them -- each in the order fmt consumes it, as an
+// int, long, long long, double, long double or pointer, or a string with its
+// terminator -- for front ends such as picolog.hpp that do the packing at
+// compile time.  channel may be NULL.
+void picolog_message_packed(const picolog_channel_t *channel,
+                            picolog_level_t severity, const char *fmt,
+                            const uint8_t *args, size_t args_length) {
+  if (severity < picolog_min_threshold || !wanted(SUBSCRIBERS_ANY, severity) ||
+      (channel != NULL && severity < channel->threshold)) {
+    STAT_ADD(filtered, 1);
+    return;
+  }
+#ifdef PICOLOG_RATE_LIMIT
+  if (!rate_limit(channel, severity, fmt)) {
+    return;
+  }
+#endif
+  if (args_length > PICOLOG_MAX_ARGS_LENGTH) {
+    args_length = PICOLOG_MAX_ARGS_LENGTH;
+  }
+  log_packed(channel, severity, fmt, false, args, args_length);
+}
+
+// step through the fields of a structured message: offset starts at 0, and
+// each call fills in field and returns true until there are no more.  A
+// record that is not structured has no fields.
+bool picolog_next_field(const picolog_record_t *record, size_t *offset,
+                        picolog_field_t *field) {
+  return record->structured &&
+         get_field(record->args, record->args_length, offset, field);
+}
+
+// number of messages suppressed so far by the rate limiter
+uint32_t picolog_suppressed(void) {
+#ifdef PICOLOG_RATE_LIMIT
+  return s_suppressed;
+#else
+  return 0;
+#endif
+}
+
+// a pseudo-random number for PICOLOG_SAMPLED(), from a xorshift generator:
+// a few shifts and no multiply, so cheap enough to draw on every hit.  Not
+// for anything that needs real randomness; two cores drawing at once may
+// get the same number.
+uint32_t picolog_random(void) {
+  uint32_t x = __atomic_load_n(&s_random, __ATOMIC_RELAXED);
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  __atomic_store_n(&s_random, x, __ATOMIC_RELAXED);
+  return x;
+}
+
+// open the trigger window for duration_us from now, or leave it as it is if
+// it is already open for longer.  The end of the window is kept in 32 bits,
+// so that both cores can read it in one load, and duration_us may be at
+// most 2^31 - 1 (about 35 minutes); longer is taken as that.  Messages at
+// PICOLOG_TRIGGER_LEVEL and above open it for PICOLOG_TRIGGER_WINDOW_US.
+void picolog_trigger(uint32_t duration_us) {
+  trigger_at(time_us_32(), duration_us < INT32_MAX ? duration_us : INT32_MAX);
+}
+
+// true while the trigger window is open.  Once it has closed this clears
+// picolog_trigger_armed, so that PICOLOG_TRIGGERED() call sites go back to
+// testing just that.
+bool picolog_trigger_active(void) {
+  if (!picolog_trigger_armed) {
+    return false;
+  }
+  if ((int32_t)(s_trigger_until - time_us_32()) > 0) {
+    return true;
+  }
+  picolog_trigger_armed = false;
+  // the other core may have opened it again since the time was read
+  if ((int32_t)(s_trigger_until - time_us_32()) > 0) {
+    picolog_trigger_armed = true;
+    return true;
+  }
+  return false;
+}
+
+// copy the counts kept under PICOLOG_STATS into stats; without it they are
+// all zero
+void picolog_get_stats(picolog_stats_t *stats) {
+#ifdef PICOLOG_STATS
+  int i;
+  *stats = s_stats;
+  for (i=0; i<PICOLOG_MAX_SUBSCRIBERS; i++) {
+    stats->subscribers[i].fn = (picolog_any_function_t)s_subscribers[i].fn;
+  }
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+// encode record as the binary frame a binary subscriber would receive, for
+// code that keeps records and sends them on later.  frame must have room for
+// PICOLOG_MAX_FRAME_LENGTH bytes.  Returns the length of the frame.
+size_t picolog_encode_frame(uint8_t *frame, const picolog_record_t *record) {
+  return encode_frame(frame, record);
+}
+
+const char *picolog_level_name(picolog_level_t severity) {
+  static const char *const names[LEVEL_COUNT] = {
+    "TRACE", "DEBUG", "INFO", "WARNING", "ERROR", "CRITICAL", "ALWAYS",
+  };
+  if (severity < PICOLOG_TRACE_LEVEL || severity > PICOLOG_ALWAYS_LEVEL) {
+    return "UNKNOWN";
+  }
+  return names[severity - PICOLOG_TRACE_LEVEL];
+}
+
+#ifdef PICOLOG_DEFERRED
+
+// copy the message into the queue: no formatting happens here.  Any core or
+// interrupt handler may log at any time.  The arguments are packed first, so
+// that the entry claimed is just big enough for them; the hardware spin lock
+// is held only to claim it -- a handful of instructions -- and the message
+// itself is copied outside of it, so producers never wait on the drain or on
+// each other's copying.
+static void log_message(const picolog_channel_t *channel, picolog_level_t severity,
+                        const char *fmt, va_list ap) {
+  uint8_t args[PICOLOG_MAX_ARGS_LENGTH];
+
+  if (severity < picolog_min_threshold || !wanted(SUBSCRIBERS_ANY, severity)) {
+    STAT_ADD(filtered, 1);
+    return;    // nobody wants the message
+  }
+#ifdef PICOLOG_RATE_LIMIT
+  if (!rate_limit(channel, severity, fmt)) {
+    return;
+  }
+#endif
+  log_packed(channel, severity, fmt, false, args, pack_args(args, fmt, ap));
+}
+
+// queue a message whose arguments have been packed
+static void log_packed(const picolog_channel_t *channel, picolog_level_t severity,
+                       const char *fmt, bool structured, const uint8_t *args,
+                       size_t args_length) {
+  entry_t *entry;
+  uint32_t position, sequence, save;
+  uint64_t timestamp = time_us_64();
+
+  if (s_queue_lock == NULL) {
+    return;    // not yet initialised
+  }
+  STAT_ADD(logged[level_index(severity)], 1);
+  if (severity >= PICOLOG_TRIGGER_LEVEL) {
+    trigger_at((uint32_t)timestamp, PICOLOG_TRIGGER_WINDOW_US);
+  }
+  save = spin_lock_blocking(s_queue_lock);
+  entry = claim_entry(severity, ENTRY_SIZE(args_length), &save, &position);
+  sequence = s_sequence++;
+  spin_unlock(s_queue_lock, save);
+  if (entry == NULL) {
+    return;    // queue full: the message is dropped
+  }
+
+  entry->args_length = (uint16_t)args_length;
+  entry->sequence = sequence;
+  entry->timestamp[0] = (uint32_t)timestamp;
+  entry->timestamp[1] = (uint32_t)(timestamp >> 32);
+  entry->channel = channel;
+  entry->fmt = fmt;
+  entry->severity = (uint8_t)severity;
+  entry->core = (uint8_t)get_core_num();
+  entry->structured = structured;
+  memcpy(entry->args, args, args_length);
+  TURN_STORE(entry, position + 1);    // the entry is complete: make it visible
+#ifdef PICOLOG_DRAIN_CORE1
+  __sev();    // wake the drain on core1
+#endif
+}
+
+// format and deliver every queued message, returning how many were delivered.
+// This is the single drain point of the queue: if it is already running
+// elsewhere (on the other core, or in code it has interrupted) it returns 0.
+int picolog_flush(void) {
+  int count = 0;
+  uint32_t save;
+
+  if (s_queue_lock == NULL) {
+    return 0;
+  }
+  save = spin_lock_blocking(s_queue_lock);
+  if (s_draining) {
+    spin_unlock(s_queue_lock, save);
+    return 0;
+  }
+  s_draining = true;
+  spin_unlock(s_queue_lock, save);
+#ifdef PICOLOG_RATE_LIMIT
+  report_suppressed();
+#endif
+
+  for (;;) {
+    record_t record;
+    entry_t *entry;
+    // the message is copied out of the queue under the lock, which frees its
+    // space at once and keeps PICOLOG_OVERFLOW_OVERWRITE_OLDEST from evicting
+    // it part way through
+    save = spin_lock_blocking(s_queue_lock);
+    entry = oldest_entry();
+    if (entry == NULL) {
+      // empty, or the next message is still being written.  If empty, any
+      // messages dropped since the last one delivered are reported now.
+      uint32_t next = s_queue_head == s_queue_tail ? s_sequence : s_expected;
+      spin_unlock(s_queue_lock, save);
+      if (next != s_expected) {
+        report_dropped(s_expected, next - s_expected);
+        s_expected = next;
+      }
+      break;
+    }
+    record.sequence = entry->sequence;
+    record.severity = (picolog_level_t)entry->severity;
+    record.channel = entry->channel;
+    record.fmt = entry->fmt;
+    record.timestamp = entry->timestamp[0] | (uint64_t)entry->timestamp[1] << 32;
+    record.core = entry->core;
+    record.structured = entry->structured;
+    record.args_length = entry->args_length;
+    memcpy(record.args, entry->args, entry->args_length);
+    s_queue_tail += entry->size;
+    spin_unlock(s_queue_lock, save);
+    if (record.sequence != s_expected) {
+      report_dropped(s_expected, record.sequence - s_expected);
+    }
+    s_expected = record.sequence + 1;
+    deliver(&record);
+    count++;
+  }
+  batch_flush();
+  save = spin_lock_blocking(s_queue_lock);
+  s_draining = false;
+  spin_unlock(s_queue_lock, save);
+  return count;
+}
+
+// number of messages lost so far because the queue was full when they were
+// logged, or evicted from it under PICOLOG_OVERFLOW_OVERWRITE_OLDEST.  Each
+// lost message also leaves a gap in the sequence numbers, and the next
+// message delivered after a loss is preceded by a report of how many.
+uint32_t picolog_overruns(void) {
+  return s_overruns;
+}
+
+// the number of messages of one level lost in the same way
+uint32_t picolog_dropped(picolog_level_t level) {
+  return s_dropped[level_index(level)];
+}
+
+// deliver the messages waiting in the queues of subscribers that have them
+// (see picolog_subscriber_queued()), returning how many were delivered.
+// Call it wherever slow output can wait: from the main loop when the drain
+// is on core1, or after picolog_flush() otherwise.  Like picolog_flush() it
+// must only run in one place at a time, but it may run alongside the drain.
+int picolog_flush_queued(void) {
+  int count = 0;
+  int i;
+  for (i=0; i<PICOLOG_SUBSCRIBER_QUEUES; i++) {
+    subscriber_queue_t *q = &s_subscriber_queues[i];
+    uint32_t tail = q->tail;
+    if (__atomic_load_n(&q->subscriber.fn, __ATOMIC_ACQUIRE) == NULL) {
+      continue;
+    }
+    while (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+      deliver_queued(&q->subscriber, &q->records[tail % PICOLOG_SUBSCRIBER_QUEUE_LENGTH]);
+      tail++;
+      __atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);    // the slot is free
+      count++;
+    }
+  }
+  return count;
+}
+
+// the number of messages the queued subscriber fn has lost because its
+// queue was full
+uint32_t picolog_queued_dropped(picolog_any_function_t fn) {
+  int i;
+  for (i=0; i<PICOLOG_SUBSCRIBER_QUEUES; i++) {
+    if (s_subscriber_queues[i].subscriber.fn == (subscriber_fn_t)fn) {
+      return __atomic_load_n(&s_subscriber_queues[i].dropped, __ATOMIC_RELAXED);
+    }
+  }
+  return 0;
+}
+
+#else
+
+static void log_message(const picolog_channel_t *channel, picolog_level_t severity,
+                        const char *fmt, va_list ap) {
+  va_list copy;
+  record_t record;
+  scratch_t *scratch;
+  size_t text_length = 0;
+  int n;
+
+  if (severity < picolog_min_threshold || !wanted(SUBSCRIBERS_ANY, severity)) {
+    STAT_ADD(filtered, 1);
+    return;
+  }
+#ifdef PICOLOG_RATE_LIMIT
+  if (!rate_limit(channel, severity, fmt)) {
+    return;
+  }
+#endif
+  STAT_ADD(logged[level_index(severity)], 1);
+  record.timestamp = time_us_64();
+  if (severity >= PICOLOG_TRIGGER_LEVEL) {
+    trigger_at((uint32_t)record.timestamp, PICOLOG_TRIGGER_WINDOW_US);
+  }
+  scratch = scratch_claim();
+  if (scratch == NULL) {
+    return;
+  }
+  record.sequence = s_sequence++;
+  record.severity = severity;
+  record.channel = channel;
+  record.fmt = fmt;
+  record.core = get_core_num();
+  record.structured = false;
+  record.args_length = 0;
+  if (wanted(SUBSCRIBERS_WITH_ARGS, severity)) {
+    va_copy(copy, ap);
+    record.args_length = pack_args(record.args, fmt, copy);
+    va_end(copy);
+  }
+  if (wanted(SUBSCRIBERS_WITH_TEXT, severity)) {
+    n = VSNPRINTF(scratch->message, PICOLOG_MAX_MESSAGE_LENGTH, fmt, ap);
+    text_length = n < 0 ? 0 : n < PICOLOG_MAX_MESSAGE_LENGTH ? n : PICOLOG_MAX_MESSAGE_LENGTH - 1;
+    STAT_ADD(bytes_formatted, text_length);
+    if (n >= PICOLOG_MAX_MESSAGE_LENGTH) {
+      STAT_ADD(truncated, 1);
+    }
+  }
+  dispatch(&record, scratch, text_length);
+  scratch_release();
+}
+
+// deliver a message whose arguments have been packed
+static void log_packed(const picolog_channel_t *channel, picolog_level_t severity,
+                       const char *fmt, bool structured, const uint8_t *args,
+                       size_t args_length) {
+  record_t record;
+  scratch_t *scratch = scratch_claim();
+  size_t text_length = 0;
+
+  STAT_ADD(logged[level_index(severity)], 1);
+  record.timestamp = time_us_64();
+  if (severity >= PICOLOG_TRIGGER_LEVEL) {
+    trigger_at((uint32_t)record.timestamp, PICOLOG_TRIGGER_WINDOW_US);
+  }
+  if (scratch == NULL) {
+    return;
+  }
+  record.sequence = s_sequence++;
+  record.severity = severity;
+  record.channel = channel;
+  record.fmt = fmt;
+  record.core = get_core_num();
+  record.structured = structured;
+  record.args_length = args_length;
+  memcpy(record.args, args, args_length);
+  if (wanted(SUBSCRIBERS_WITH_TEXT, severity)) {
+    text_length = render_text(scratch->message, PICOLOG_MAX_MESSAGE_LENGTH, &record);
+  }
+  dispatch(&record, scratch, text_length);
+  scratch_release();
+}
+
+// messages are delivered as they are logged: only the rate limiter's
+// reports of suppressed messages wait for this
+int picolog_flush(void) {
+#ifdef PICOLOG_RATE_LIMIT
+  report_suppressed();
+#endif
+  return 0;
+}
+
+uint32_t picolog_overruns(void) {
+  return 0;
+}
+
+uint32_t picolog_dropped(picolog_level_t level) {
+  (void)level;
+  return 0;
+}
+
+int picolog_flush_queued(void) {
+  return 0;
+}
+
+uint32_t picolog_queued_dropped(picolog_any_function_t fn) {
+  (void)fn;
+  return 0;
+}
+
+#endif
+
+// =============================================================================
+// private code
+
+// search the s_subscribers table to install fn, or update its levels
+static picolog_err_t subscribe(subscriber_kind_t kind, subscriber_fn_t fn,
+                               picolog_levels_t levels) {
   int available_slot = -1;
   int i;
   for (i=0; i<PICOLOG_MAX_SUBSCRIBERS; i++) {
     if (s_subscribers[i].fn == fn) {
-      // already subscribed: update threshold and return immediately.
-      s_subscribers[i].threshold = threshold;
+      // already subscribed: update levels and return immediately.
+      s_subscribers[i].levels = levels;
+      update_routes();
       return PICOLOG_ERR_NONE;
 
     } else if (s_subscribers[i].fn == NULL) {
@@ -80,55 +1073,1142 @@ picolog_err_t picolog_subscribe(picolog_function_t fn, picolog_level_t threshold
   if (available_slot == -1) {
     return PICOLOG_ERR_SUBSCRIBERS_EXCEEDED;
   }
+  s_subscribers[available_slot].levels = levels;
+  s_subscribers[available_slot].kind = kind;
+  s_subscribers[available_slot].channel = NULL;
+  s_subscribers[available_slot].slot = (uint8_t)available_slot;
+  s_subscribers[available_slot].queue = NO_QUEUE;
   s_subscribers[available_slot].fn = fn;
-  s_subscribers[available_slot].threshold = threshold;
+#ifdef PICOLOG_STATS
+  s_stats.subscribers[available_slot].time = 0;    // not the last one's
+#endif
+  update_routes();
   return PICOLOG_ERR_NONE;
 }
 
-// search the s_subscribers table to remove
-picolog_err_t picolog_unsubscribe(picolog_function_t fn) {
+// search the s_subscribers table to remove fn
+static picolog_err_t unsubscribe(subscriber_fn_t fn) {
   int i;
   for (i=0; i<PICOLOG_MAX_SUBSCRIBERS; i++) {
     if (s_subscribers[i].fn == fn) {
+#ifdef PICOLOG_DEFERRED
+      queue_detach(&s_subscribers[i]);
+#endif
       s_subscribers[i].fn = NULL;    // mark as empty
+      update_routes();
       return PICOLOG_ERR_NONE;
     }
   }
   return PICOLOG_ERR_NOT_SUBSCRIBED;
 }
 
-const char *picolog_level_name(picolog_level_t severity) {
-  switch(severity) {
-   case PICOLOG_TRACE_LEVEL: return "TRACE";
-   case PICOLOG_DEBUG_LEVEL: return "DEBUG";
-   case PICOLOG_INFO_LEVEL: return "INFO";
-   case PICOLOG_WARNING_LEVEL: return "WARNING";
-   case PICOLOG_ERROR_LEVEL: return "ERROR";
-   case PICOLOG_CRITICAL_LEVEL: return "CRITICAL";
-   case PICOLOG_ALWAYS_LEVEL: return "ALWAYS";
-   default: return "UNKNOWN";
+// rebuild the routes and picolog_min_threshold after the s_subscribers table
+// has changed.  Subscribing and unsubscribing must not happen from more than
+// one place at a time, nor twice in the time the drain takes to deliver a
+// message, since the set being rebuilt is then the one the drain was using.
+static void update_routes(void) {
+  uint8_t set = !s_route_set;
+  picolog_level_t min = NO_SUBSCRIBERS_LEVEL;
+  int level, i;
+
+  for (level=LEVEL_COUNT-1; level>=0; level--) {
+    route_t *r = &s_routes[set][level];
+    r->kinds = 0;
+    r->count = 0;
+    for (i=0; i<PICOLOG_MAX_SUBSCRIBERS; i++) {
+      if (s_subscribers[i].fn != NULL && (s_subscribers[i].levels & (1u << level))) {
+        r->subscribers[r->count++] = s_subscribers[i];
+        r->kinds |= s_subscribers[i].queue == NO_QUEUE ? s_subscribers[i].kind
+                                                        : SUBSCRIBER_QUEUED;
+      }
+    }
+    if (r->count > 0) {
+      min = (picolog_level_t)(PICOLOG_TRACE_LEVEL + level);
+    }
   }
+  s_routes[set][BATCH_ROUTE].count = 0;
+  for (i=0; i<PICOLOG_MAX_SUBSCRIBERS; i++) {
+    if (s_subscribers[i].fn != NULL && (s_subscribers[i].kind & SUBSCRIBERS_BATCH)) {
+      route_t *r = &s_routes[set][BATCH_ROUTE];
+      r->subscribers[r->count++] = s_subscribers[i];
+    }
+  }
+  // the new set must be complete before it is switched in
+  __atomic_store_n(&s_route_set, set, __ATOMIC_RELEASE);
+  picolog_min_threshold = min;
 }
 
-void picolog_message(picolog_level_t severity, const char *fmt, ...) {
+// the subscribers for messages at severity.  Levels above ALWAYS are taken as
+// ALWAYS, and those below TRACE -- which no threshold admits -- get nobody.
+static const route_t *route(picolog_level_t severity) {
+  static const route_t nobody;
+  if (severity < PICOLOG_TRACE_LEVEL) {
+    return &nobody;
+  }
+  return &s_routes[__atomic_load_n(&s_route_set, __ATOMIC_ACQUIRE)][level_index(severity)];
+}
+
+// the index of severity into per-level tables, with out of range levels
+// taken as the nearest level
+static int level_index(picolog_level_t severity) {
+  if (severity <= PICOLOG_TRACE_LEVEL) {
+    return 0;
+  } else if (severity >= PICOLOG_ALWAYS_LEVEL) {
+    return LEVEL_COUNT - 1;
+  }
+  return severity - PICOLOG_TRACE_LEVEL;
+}
+
+// true if any subscriber of one of the given kinds will take a message at
+// severity, so the work of producing its text or frame isn't wasted.
+static bool wanted(int kinds, picolog_level_t severity) {
+  return (route(severity)->kinds & kinds) != 0;
+}
+
+// claim the scratch space for a message on this core, or NULL if all
+// PICOLOG_SCRATCH_DEPTH are in use, in which case the message is dropped:
+// that also stops a subscriber that logs from recursing without end.  An
+// interrupt handler that runs between the load and store of s_depth releases
+// what it claims before returning, so the count is right either way.  The
+// message starts empty, which is the text a record subscriber gets when
+// nobody wanted it formatted.
+static scratch_t *scratch_claim(void) {
+  unsigned int core = get_core_num();
+  uint8_t depth = s_depth[core];
+  if (depth >= PICOLOG_SCRATCH_DEPTH) {
+    return NULL;
+  }
+  s_depth[core] = depth + 1;
+  s_scratch[core][depth].message[0] = '\0';
+  return &s_scratch[core][depth];
+}
+
+// release the scratch space last claimed on this core
+static void scratch_release(void) {
+  s_depth[get_core_num()]--;
+}
+
+// deliver record to every subscriber that takes its level.  scratch holds
+// the formatted message, if any subscriber wants it; the binary frame is
+// only encoded into it when the first binary subscriber needs it.
+static void dispatch(const record_t *record, scratch_t *scratch, size_t text_length) {
+  picolog_record_t view;
+  size_t frame_length = 0;
+  const route_t *r = route(record->severity);
+  int i;
+
+  make_view(&view, record, scratch->message, text_length);
+#ifdef PICOLOG_DEFERRED
+  if (r->kinds & SUBSCRIBERS_BATCH) {
+    batch_add(&view);
+  }
+#endif
+  for (i=0; i<r->count; i++) {
+    const subscriber_t *s = &r->subscribers[i];
+    if (s->channel != NULL && s->channel != record->channel) {
+      continue;
+    }
+#ifdef PICOLOG_DEFERRED
+    if (s->queue != NO_QUEUE) {
+      queue_record(s, record);
+      continue;
+    }
+#endif
+    call_subscriber(s, &view, scratch, &frame_length);
+  }
+}
+
+// the view of record that subscribers are given, with text its formatted
+// message
+static void make_view(picolog_record_t *view, const record_t *record, char *text,
+                      size_t text_length) {
+  view->severity = record->severity;
+  view->timestamp = record->timestamp;
+  view->sequence = record->sequence;
+  view->core = record->core;
+  view->structured = record->structured;
+  view->channel = record->channel;
+  view->fmt = record->fmt;
+  view->args = record->args;
+  view->args_length = record->args_length;
+  view->text = text;
+  view->text_length = text_length;
+}
+
+// pass view, whose text is in scratch, to one subscriber, encoding the frame
+// into scratch too unless frame_length says that has been done already
+static void call_subscriber(const subscriber_t *s, const picolog_record_t *view,
+                            scratch_t *scratch, size_t *frame_length) {
+#ifdef PICOLOG_STATS
+  uint32_t start = PICOLOG_STATS_CLOCK();
+#endif
+  switch (s->kind) {
+    case SUBSCRIBER_TEXT:
+      ((picolog_function_t)s->fn)(view->severity, scratch->message);
+      break;
+    case SUBSCRIBER_TIMED:
+      ((picolog_timed_function_t)s->fn)(view->severity, view->timestamp,
+                                        scratch->message);
+      break;
+    case SUBSCRIBER_RECORD:
+    case SUBSCRIBER_RECORD_ARGS:
+      ((picolog_record_function_t)s->fn)(view);
+      break;
+    case SUBSCRIBER_BINARY:
+      if (*frame_length == 0) {
+        *frame_length = encode_frame(scratch->frame, view);
+      }
+      ((picolog_binary_function_t)s->fn)(view->severity, scratch->frame, *frame_length);
+      break;
+    case SUBSCRIBER_BATCH:
+    case SUBSCRIBER_BATCH_TEXT:
+#ifndef PICOLOG_DEFERRED
+      ((picolog_batch_function_t)s->fn)(view, 1);
+#endif
+      break;
+  }
+  STAT_ADD(subscribers[s->slot].time, PICOLOG_STATS_CLOCK() - start);
+}
+
+static void cobs_init(cobs_t *cobs, uint8_t *frame) {
+  cobs->frame = frame;
+  cobs->code = 0;
+  cobs->length = 1;
+  cobs->count = 1;
+}
+
+static void cobs_put(cobs_t *cobs, uint8_t byte) {
+  if (byte != 0) {
+    cobs->frame[cobs->length++] = byte;
+    cobs->count++;
+  }
+  if (byte == 0 || cobs->count == 0xFF) {
+    cobs->frame[cobs->code] = cobs->count;
+    cobs->code = cobs->length++;
+    cobs->count = 1;
+  }
+}
+
+static void cobs_put_u32(cobs_t *cobs, uint32_t value) {
+  int i;
+  for (i=0; i<4; i++) {
+    cobs_put(cobs, (uint8_t)(value >> (8 * i)));
+  }
+}
+
+// close the last block and append the 0x00 delimiter.  returns frame length.
+static size_t cobs_end(cobs_t *cobs) {
+  cobs->frame[cobs->code] = cobs->count;
+  cobs->frame[cobs->length++] = 0;
+  return cobs->length;
+}
+
+// encode record as a binary frame: the level, the address of the format
+// string (which tools/picolog_decode.py looks up in the ELF file), the low
+// 32 bits of the timestamp in microseconds and the packed arguments, all
+// little endian, COBS encoded and terminated by a zero byte.  The top bit of
+// the level is set for a structured message, whose arguments are fields.
+static size_t encode_frame(uint8_t *frame, const picolog_record_t *record) {
+  size_t length = record->args_length < PICOLOG_MAX_ARGS_LENGTH ?
+                  record->args_length : PICOLOG_MAX_ARGS_LENGTH;
+  cobs_t cobs;
+  size_t i;
+  cobs_init(&cobs, frame);
+  cobs_put(&cobs, (uint8_t)((record->severity - PICOLOG_TRACE_LEVEL) |
+                            (record->structured ? 0x80 : 0)));
+  cobs_put_u32(&cobs, (uint32_t)(uintptr_t)record->fmt);
+  cobs_put_u32(&cobs, (uint32_t)record->timestamp);
+  for (i=0; i<length; i++) {
+    cobs_put(&cobs, record->args[i]);
+  }
+  return cobs_end(&cobs);
+}
+
+#ifdef PICOLOG_RATE_LIMIT
+
+// log a message from within picolog
+static void log_internal(const picolog_channel_t *channel, picolog_level_t severity,
+                         const char *fmt, ...) {
   va_list ap;
+  va_start(ap, fmt);
+  log_message(channel, severity, fmt, ap);
+  va_end(ap);
+}
+
+// the token bucket for the call site that logs fmt: true if the message may
+// be logged, false if it is to be suppressed.  Each site may log a burst of
+// PICOLOG_RATE_LIMIT_BURST messages, and after that one message per
+// PICOLOG_RATE_LIMIT_INTERVAL_US.  This runs before any formatting, so a
+// suppressed message costs a hash and a compare.  The first message a site
+// logs after some were suppressed is preceded by a report of how many, and
+// if it logs none, picolog_flush() reports them once its interval is up.
+//
+// Sites are hashed on fmt into a table of PICOLOG_RATE_LIMIT_SITES entries;
+// a site that collides with another takes over its entry, reporting first
+// any suppressed messages of the other's that haven't been.
+static bool rate_limit(const picolog_channel_t *channel, picolog_level_t severity,
+                       const char *fmt) {
+  uint64_t now = time_us_64();
+  site_t *site = &s_sites[((uint32_t)(uintptr_t)fmt * 2654435761u >> 8) %
+                          PICOLOG_RATE_LIMIT_SITES];
+  uint32_t suppressed = 0;
+  site_t evicted = { NULL, 0, 0, NULL, PICOLOG_TRACE_LEVEL };
+  bool allowed;
+#ifdef PICOLOG_DEFERRED
+  uint32_t save;
+#endif
+
+  if (fmt == s_suppressed_fmt) {
+    return true;
+  }
+#ifdef PICOLOG_DEFERRED
+  save = spin_lock_blocking(s_queue_lock);
+#endif
+  if (site->fmt != fmt) {
+    evicted = *site;
+    site->fmt = fmt;
+    site->due = now;
+    site->suppressed = 0;
+  }
+  allowed = site->due <= now + RATE_LIMIT_SLACK;
+  if (allowed) {
+    site->due = (site->due > now ? site->due : now) + PICOLOG_RATE_LIMIT_INTERVAL_US;
+    suppressed = site->suppressed;
+    site->suppressed = 0;
+  } else {
+    site->suppressed++;
+    site->channel = channel;
+    site->severity = severity;
+    s_suppressed++;
+  }
+#ifdef PICOLOG_DEFERRED
+  spin_unlock(s_queue_lock, save);
+#endif
+  if (evicted.suppressed > 0) {
+    log_internal(evicted.channel, evicted.severity, s_suppressed_fmt,
+                 (unsigned long)evicted.suppressed, evicted.fmt);
+  }
+  if (suppressed > 0) {
+    log_internal(channel, severity, s_suppressed_fmt, (unsigned long)suppressed, fmt);
+  }
+  return allowed;
+}
+
+// report the messages suppressed at each site that has since earned another
+// message, so that the size of a storm that has stopped is still told
+static void report_suppressed(void) {
+  uint64_t now = time_us_64();
   int i;
+  for (i=0; i<PICOLOG_RATE_LIMIT_SITES; i++) {
+    site_t *site = &s_sites[i];
+    site_t pending;
+#ifdef PICOLOG_DEFERRED
+    uint32_t save = spin_lock_blocking(s_queue_lock);
+#endif
+    pending = *site;
+    if (site->suppressed > 0 && site->due <= now + RATE_LIMIT_SLACK) {
+      site->suppressed = 0;
+    } else {
+      pending.suppressed = 0;
+    }
+#ifdef PICOLOG_DEFERRED
+    spin_unlock(s_queue_lock, save);
+#endif
+    if (pending.suppressed > 0) {
+      log_internal(pending.channel, pending.severity, s_suppressed_fmt,
+                   (unsigned long)pending.suppressed, pending.fmt);
+    }
+  }
+}
+
+#endif
+
+#ifdef PICOLOG_DEFERRED
+
+static void queue_init(void) {
+  if (s_queue_lock == NULL) {
+    s_queue_lock = spin_lock_instance(spin_lock_claim_unused(true));
+  }
+  // stale turns left in s_queue can't match: an entry is always marked as
+  // claimed before the drain gets to it
+  s_queue_head = s_queue_tail = 0;
+  s_sequence = 0;
+  s_overruns = s_expected = 0;
+  memset(s_dropped, 0, sizeof(s_dropped));
+}
+
+// count a message at severity as lost.  s_queue_lock must be held.
+static void count_drop(picolog_level_t severity) {
+  s_overruns++;
+  s_dropped[level_index(severity)]++;
+}
+
+static entry_t *entry_at(uint32_t position) {
+  return (entry_t *)&s_queue[position % PICOLOG_QUEUE_SIZE];
+}
+
+// bytes of padding needed at head for an entry of size bytes not to wrap
+static uint32_t wrap_padding(uint32_t head, size_t size) {
+  uint32_t offset = head % PICOLOG_QUEUE_SIZE;
+  return offset + size > PICOLOG_QUEUE_SIZE ? PICOLOG_QUEUE_SIZE - offset : 0;
+}
+
+// true if size more bytes fit in the queue
+static bool has_room(uint32_t size) {
+  return s_queue_head + size - s_queue_tail <= PICOLOG_QUEUE_SIZE;
+}
+
+// with s_queue_lock held, claim an entry of size bytes for the next message
+// or, if the queue is full, apply PICOLOG_OVERFLOW_POLICY.  Returns NULL if
+// the message is to be dropped, and otherwise sets position to the entry's
+// queue position.  The lock may be released and retaken while waiting,
+// hence save.
+static entry_t *claim_entry(picolog_level_t severity, size_t size, uint32_t *save,
+                            uint32_t *position) {
+  uint32_t padding = wrap_padding(s_queue_head, size);
+  entry_t *entry;
+  (void)save;    // only needed by PICOLOG_OVERFLOW_BLOCK
+
+#if PICOLOG_OVERFLOW_POLICY == PICOLOG_OVERFLOW_RESERVE
+  // the last few free bytes are kept for severe messages
+  if (severity < PICOLOG_OVERFLOW_RESERVE_LEVEL &&
+      !has_room(padding + size + PICOLOG_OVERFLOW_RESERVED_BYTES)) {
+    count_drop(severity);
+    return NULL;
+  }
+#elif PICOLOG_OVERFLOW_POLICY == PICOLOG_OVERFLOW_BLOCK
+  // wait for the drain, but never in an interrupt handler, which could be
+  // holding up the drain itself
+  if (!has_room(padding + size) && __get_current_exception() == 0) {
+    uint64_t deadline = time_us_64() + PICOLOG_OVERFLOW_TIMEOUT_US;
+    do {
+      spin_unlock(s_queue_lock, *save);
+      busy_wait_us_32(1);
+      *save = spin_lock_blocking(s_queue_lock);
+      padding = wrap_padding(s_queue_head, size);
+    } while (!has_room(padding + size) && time_us_64() < deadline);
+  }
+#elif PICOLOG_OVERFLOW_POLICY == PICOLOG_OVERFLOW_OVERWRITE_OLDEST
+  // evict the oldest messages, provided that they are complete, and reuse
+  // their space
+  while (!has_room(padding + size)) {
+    entry = oldest_entry();
+    if (entry == NULL) {
+      break;
+    }
+    count_drop((picolog_level_t)entry->severity);
+    s_queue_tail += entry->size;
+  }
+#endif
+  if (!has_room(padding + size)) {
+    count_drop(severity);
+    return NULL;
+  }
+  if (padding >= sizeof(entry_t)) {
+    entry = entry_at(s_queue_head);
+    entry->size = (uint16_t)padding;
+    entry->fmt = NULL;
+    TURN_STORE(entry, s_queue_head + 1);
+  }
+  *position = s_queue_head + padding;
+  s_queue_head = *position + size;
+#ifdef PICOLOG_STATS
+  if (s_queue_head - s_queue_tail > s_stats.queue_high_water) {
+    __atomic_store_n(&s_stats.queue_high_water, s_queue_head - s_queue_tail,
+                     __ATOMIC_RELAXED);
+  }
+#endif
+  entry = entry_at(*position);
+  entry->size = (uint16_t)size;
+  TURN_STORE(entry, *position);    // claimed, not yet complete
+  return entry;
+}
+
+// with s_queue_lock held, the oldest message in the queue, or NULL if the
+// queue is empty or that message is still being written.  Padding before it
+// is released on the way.
+static entry_t *oldest_entry(void) {
+  while (s_queue_tail != s_queue_head) {
+    uint32_t position = s_queue_tail;
+    uint32_t rest = PICOLOG_QUEUE_SIZE - position % PICOLOG_QUEUE_SIZE;
+    entry_t *entry;
+    if (rest < sizeof(entry_t)) {
+      s_queue_tail += rest;    // too short for an entry: skipped
+      continue;
+    }
+    entry = entry_at(position);
+    if (TURN_LOAD(entry) != position + 1) {
+      return NULL;
+    }
+    if (entry->fmt != NULL) {
+      return entry;
+    }
+    s_queue_tail += entry->size;
+  }
+  return NULL;
+}
+
+// format record, if anyone wants the text, and pass it to the subscribers
+static void deliver(const record_t *record) {
+  scratch_t *scratch = scratch_claim();
+  size_t text_length = 0;
+  if (scratch == NULL) {
+    return;
+  }
+  if (wanted(SUBSCRIBERS_WITH_TEXT, record->severity)) {
+    text_length = render_text(scratch->message, PICOLOG_MAX_MESSAGE_LENGTH, record);
+  }
+  dispatch(record, scratch, text_length);
+  scratch_release();
+}
+
+static size_t pack_internal(uint8_t *args, const char *fmt, ...) {
+  va_list ap;
+  size_t length;
   va_start(ap, fmt);
-  vsnprintf(s_message, PICOLOG_MAX_MESSAGE_LENGTH, fmt, ap);
+  length = pack_args(args, fmt, ap);
   va_end(ap);
+  return length;
+}
 
-  for (i=0; i<PICOLOG_MAX_SUBSCRIBERS; i++) {
-    if (s_subscribers[i].fn != NULL) {
-      if (severity >= s_subscribers[i].threshold) {
-        s_subscribers[i].fn(severity, s_message);
+// add a copy of record to the batch for batch subscribers, first passing on
+// the batch so far if there is no room for it.  The text is only copied if
+// a batch subscriber that wants it takes the record's level.
+static void batch_add(const picolog_record_t *record) {
+  picolog_record_t *copy;
+  char *text;
+  size_t text_length = 0;
+  if (wanted(SUBSCRIBER_BATCH_TEXT, record->severity)) {
+    text_length = record->text_length;
+  }
+  if (s_batch_count == PICOLOG_BATCH_LENGTH ||
+      s_batch_text_used + text_length + 1 > PICOLOG_BATCH_TEXT_SIZE) {
+    batch_flush();
+  }
+  copy = &s_batch[s_batch_count];
+  *copy = *record;
+  memcpy(s_batch_args[s_batch_count], record->args, record->args_length);
+  copy->args = s_batch_args[s_batch_count];
+  text = &s_batch_text[s_batch_text_used];
+  memcpy(text, record->text, text_length);
+  text[text_length] = '\0';
+  copy->text = text;
+  copy->text_length = text_length;
+  s_batch_text_used += text_length + 1;
+  s_batch_count++;
+}
+
+// pass each batch subscriber the runs of records in the batch that it takes
+static void batch_flush(void) {
+  const route_t *r = &s_routes[__atomic_load_n(&s_route_set, __ATOMIC_ACQUIRE)][BATCH_ROUTE];
+  int i;
+  for (i=0; i<r->count; i++) {
+    const subscriber_t *s = &r->subscribers[i];
+    size_t start = 0;
+    size_t j;
+    for (j=0; j<=s_batch_count; j++) {
+      if (j == s_batch_count ||
+          !(s->levels & (1u << level_index(s_batch[j].severity))) ||
+          (s->channel != NULL && s->channel != s_batch[j].channel)) {
+        if (j > start) {
+#ifdef PICOLOG_STATS
+          uint32_t clock = PICOLOG_STATS_CLOCK();
+#endif
+          ((picolog_batch_function_t)s->fn)(&s_batch[start], j - start);
+          STAT_ADD(subscribers[s->slot].time, PICOLOG_STATS_CLOCK() - clock);
+        }
+        start = j + 1;
       }
     }
   }
+  s_batch_count = 0;
+  s_batch_text_used = 0;
 }
 
-// =============================================================================
-// private code
+// deliver a WARNING that the count messages from sequence on were lost.  It
+// is made up by the drain when it comes to the gap they left, rather than
+// queued, so it can't be lost itself, and it takes the sequence number of
+// the first of them.
+static void report_dropped(uint32_t sequence, uint32_t count) {
+  record_t record;
+  if (!wanted(SUBSCRIBERS_ANY, PICOLOG_WARNING_LEVEL)) {
+    return;
+  }
+  make_dropped(&record, sequence, count);
+  deliver(&record);
+}
+
+// fill in record as the WARNING that the count messages from sequence on
+// were lost
+static void make_dropped(record_t *record, uint32_t sequence, uint32_t count) {
+  record->sequence = sequence;
+  record->severity = PICOLOG_WARNING_LEVEL;
+  record->channel = NULL;
+  record->fmt = s_dropped_fmt;
+  record->timestamp = time_us_64();
+  record->core = get_core_num();
+  record->structured = false;
+  record->args_length = pack_internal(record->args, s_dropped_fmt, (unsigned long)count);
+}
+
+// give the subscriber s a free queue.  The queue is only written to once
+// update_routes() has copied s into the routes, so it can be reset here.
+static picolog_err_t queue_attach(subscriber_t *s) {
+  int i;
+  if (s->queue != NO_QUEUE) {
+    return PICOLOG_ERR_NONE;
+  }
+  for (i=0; i<PICOLOG_SUBSCRIBER_QUEUES; i++) {
+    subscriber_queue_t *q = &s_subscriber_queues[i];
+    if (q->subscriber.fn == NULL) {
+      q->subscriber = *s;
+      q->head = q->tail = 0;
+      q->dropped = q->reported = 0;
+      __atomic_store_n(&q->subscriber.fn, s->fn, __ATOMIC_RELEASE);
+      s->queue = (int8_t)i;
+      update_routes();
+      return PICOLOG_ERR_NONE;
+    }
+  }
+  return PICOLOG_ERR_QUEUES_EXCEEDED;
+}
+
+// take away the queue of the subscriber s, if it has one, and return true
+// if it did.  The caller then rebuilds the routes, once for this and any
+// other change it makes to s.  Until then the drain may still copy a
+// message into the queue, but picolog_flush_queued() no longer delivers
+// it, and the queue can't be given to another subscriber before the
+// routes are rebuilt.
+static bool queue_detach(subscriber_t *s) {
+  int8_t queue = s->queue;
+  if (queue == NO_QUEUE) {
+    return false;
+  }
+  s->queue = NO_QUEUE;
+  __atomic_store_n(&s_subscriber_queues[queue].subscriber.fn, NULL, __ATOMIC_RELEASE);
+  return true;
+}
+
+// copy record into the queue of the subscriber s, which the route it came
+// from says takes it, or count it as lost if the queue is full.  A report
+// of earlier losses goes in ahead of it, and needs a slot of its own.
+static void queue_record(const subscriber_t *s, const record_t *record) {
+  subscriber_queue_t *q = &s_subscriber_queues[s->queue];
+  uint32_t used = q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+  bool report = q->dropped != q->reported;
+
+  if (used + report >= PICOLOG_SUBSCRIBER_QUEUE_LENGTH) {
+    if (!report) {
+      q->first_lost = record->sequence;
+    }
+    __atomic_store_n(&q->dropped, q->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  if (report && (s->levels & PICOLOG_LEVEL_BIT(PICOLOG_WARNING_LEVEL)) &&
+      s->channel == NULL) {
+    make_dropped(&q->records[q->head % PICOLOG_SUBSCRIBER_QUEUE_LENGTH],
+                 q->first_lost, q->dropped - q->reported);
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+  }
+  q->reported = q->dropped;
+  q->records[q->head % PICOLOG_SUBSCRIBER_QUEUE_LENGTH] = *record;
+  __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
+
+// format record, if s wants the text, and pass it to s alone
+static void deliver_queued(const subscriber_t *s, const record_t *record) {
+  scratch_t *scratch = scratch_claim();
+  picolog_record_t view;
+  size_t text_length = 0;
+  size_t frame_length = 0;
+  if (scratch == NULL) {
+    return;
+  }
+  if (s->kind & SUBSCRIBERS_WITH_TEXT) {
+    text_length = render_text(scratch->message, PICOLOG_MAX_MESSAGE_LENGTH, record);
+  }
+  make_view(&view, record, scratch->message, text_length);
+  call_subscriber(s, &view, scratch, &frame_length);
+  scratch_release();
+}
+
+#ifdef PICOLOG_DRAIN_CORE1
+
+// core1 entry point: drain the queue whenever a producer signals an event.
+// A __sev() that lands between an empty flush and the __wfe() leaves the
+// event flag set, so the __wfe() returns at once and no message is missed.
+static void drain_core1(void) {
+  for (;;) {
+    if (picolog_flush() == 0) {
+      __wfe();
+    }
+  }
+}
+
+#endif
+
+#endif  // #ifdef PICOLOG_DEFERRED
+
+// map an integer argument of the given size onto int, long or long long
+static arg_class_t integer_class(size_t size) {
+  if (size > sizeof(long)) {
+    return ARG_LLONG;
+  } else if (size > sizeof(int)) {
+    return ARG_LONG;
+  }
+  return ARG_INT;
+}
+
+// parse the conversion specification that starts at the '%' in fmt
+static void parse_conversion(const char *fmt, conversion_t *conv) {
+  const char *p = fmt + 1;
+  int longs = 0;
+  bool is_long_double = false;
+  size_t size = sizeof(int);
+
+  conv->start = fmt;
+  conv->stars = 0;
+  conv->shorts = 0;
+  while (*p && strchr("-+ #0", *p)) {
+    p++;
+  }
+  while ((*p >= '0' && *p <= '9') || *p == '*' || *p == '.') {
+    if (*p == '*') {
+      conv->stars++;
+    }
+    p++;
+  }
+  conv->modifier = p;
+  while (*p && strchr("hljztL", *p)) {
+    switch (*p) {
+      case 'h': conv->shorts++; break;
+      case 'l': longs++; break;
+      case 'L': is_long_double = true; break;
+      case 'j': size = sizeof(intmax_t); break;
+      case 'z': size = sizeof(size_t); break;
+      case 't': size = sizeof(ptrdiff_t); break;
+    }
+    p++;
+  }
+  if (longs == 1) {
+    size = sizeof(long);
+  } else if (longs > 1) {
+    size = sizeof(long long);
+  }
+  conv->conversion = *p;
+  conv->end = *p ? p + 1 : p;
+  switch (*p) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+      conv->arg = integer_class(size);
+      break;
+    case 'c':
+      conv->arg = ARG_INT;
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      conv->arg = is_long_double ? ARG_LDOUBLE : ARG_DOUBLE;
+      break;
+    case 'p':
+      conv->arg = ARG_POINTER;
+      break;
+    case 's':
+      conv->arg = ARG_STRING;
+      break;
+    case 'n':
+      conv->arg = ARG_IGNORE;
+      break;
+    default:
+      conv->arg = ARG_NONE;
+      break;
+  }
+}
+
+// append size bytes at value to args, returning false if they don't fit
+static bool put_arg(uint8_t *args, size_t *length, const void *value, size_t size) {
+  if (*length + size > PICOLOG_MAX_ARGS_LENGTH) {
+    return false;
+  }
+  memcpy(&args[*length], value, size);
+  *length += size;
+  return true;
+}
 
+// walk fmt and copy every argument it consumes from ap into args.  Arguments
+// that no longer fit are dropped and will be missing from the output.
+static size_t pack_args(uint8_t *args, const char *fmt, va_list ap) {
+  conversion_t conv;
+  size_t length = 0;
+  int i;
+
+  while ((fmt = strchr(fmt, '%')) != NULL) {
+    parse_conversion(fmt, &conv);
+    fmt = conv.end;
+    for (i=0; i<conv.stars; i++) {
+      int star = va_arg(ap, int);
+      if (!put_arg(args, &length, &star, sizeof(star))) return length;
+    }
+    switch (conv.arg) {
+      case ARG_INT: {
+        int value = va_arg(ap, int);
+        if (!put_arg(args, &length, &value, sizeof(value))) return length;
+        break;
+      }
+      case ARG_LONG: {
+        long value = va_arg(ap, long);
+        if (!put_arg(args, &length, &value, sizeof(value))) return length;
+        break;
+      }
+      case ARG_LLONG: {
+        long long value = va_arg(ap, long long);
+        if (!put_arg(args, &length, &value, sizeof(value))) return length;
+        break;
+      }
+      case ARG_DOUBLE: {
+        double value = va_arg(ap, double);
+        if (!put_arg(args, &length, &value, sizeof(value))) return length;
+        break;
+      }
+      case ARG_LDOUBLE: {
+        long double value = va_arg(ap, long double);
+        if (!put_arg(args, &length, &value, sizeof(value))) return length;
+        break;
+      }
+      case ARG_POINTER: {
+        void *value = va_arg(ap, void *);
+        if (!put_arg(args, &length, &value, sizeof(value))) return length;
+        break;
+      }
+      case ARG_IGNORE:
+        (void)va_arg(ap, void *);
+        break;
+      case ARG_STRING: {
+        // strings are copied (truncated if need be) since the caller's
+        // buffer may be gone by the time the message is formatted.
+        const char *value = va_arg(ap, const char *);
+        size_t n = strlen(value ? value : "(null)");
+        if (length >= PICOLOG_MAX_ARGS_LENGTH) return length;
+        if (n > PICOLOG_MAX_ARGS_LENGTH - length - 1) {
+          n = PICOLOG_MAX_ARGS_LENGTH - length - 1;
+        }
+        memcpy(&args[length], value ? value : "(null)", n);
+        args[length + n] = '\0';
+        length += n + 1;
+        break;
+      }
+      case ARG_NONE:
+        break;
+    }
+  }
+  return length;
+}
+
+// pack count fields into args as a type byte, the key pointer and the value
+// for each, as far as they fit.  Strings are copied, and truncated if need
+// be, like %s arguments; any other field that doesn't fit is left out along
+// with those after it.
+static size_t pack_fields(uint8_t *args, const picolog_field_t *fields, size_t count) {
+  size_t length = 0;
+  size_t i;
+
+  for (i=0; i<count; i++) {
+    const picolog_field_t *field = &fields[i];
+    size_t start = length;
+    uint8_t type = (uint8_t)field->type;
+    bool fits = put_arg(args, &length, &type, sizeof(type)) &&
+                put_arg(args, &length, &field->key, sizeof(field->key));
+    if (fits) {
+      switch (field->type) {
+        case PICOLOG_FIELD_I32:
+        case PICOLOG_FIELD_U32:
+          fits = put_arg(args, &length, &field->value.u32, sizeof(field->value.u32));
+          break;
+        case PICOLOG_FIELD_I64:
+          fits = put_arg(args, &length, &field->value.i64, sizeof(field->value.i64));
+          break;
+        case PICOLOG_FIELD_FLOAT:
+          fits = put_arg(args, &length, &field->value.f, sizeof(field->value.f));
+          break;
+        case PICOLOG_FIELD_BOOL: {
+          uint8_t value = field->value.u32 != 0;
+          fits = put_arg(args, &length, &value, sizeof(value));
+          break;
+        }
+        case PICOLOG_FIELD_STR: {
+          const char *value = field->value.str ? field->value.str : "(null)";
+          size_t n = strlen(value);
+          fits = length < PICOLOG_MAX_ARGS_LENGTH;
+          if (fits) {
+            if (n > PICOLOG_MAX_ARGS_LENGTH - length - 1) {
+              n = PICOLOG_MAX_ARGS_LENGTH - length - 1;
+            }
+            memcpy(&args[length], value, n);
+            args[length + n] = '\0';
+            length += n + 1;
+          }
+          break;
+        }
+        default:
+          fits = false;
+          break;
+      }
+    }
+    if (!fits) {
+      return start;
+    }
+  }
+  return length;
+}
+
+// copy size bytes from args into value, returning false if args is exhausted
+static bool get_arg(const uint8_t *args, size_t args_length, size_t *offset,
+                    void *value, size_t size) {
+  if (*offset + size > args_length) {
+    return false;
+  }
+  memcpy(value, &args[*offset], size);
+  *offset += size;
+  return true;
+}
+
+// rebuild conv as a self-contained printf spec, substituting the values of
+// any '*' arguments and normalising the length modifier to match arg.
+static bool build_spec(char *spec, size_t size, const conversion_t *conv,
+                       const uint8_t *args, size_t args_length, size_t *offset) {
+  static const char *modifiers[] = {
+    [ARG_LONG] = "l", [ARG_LLONG] = "ll", [ARG_LDOUBLE] = "L",
+  };
+  const char *modifier = NULL;
+  const char *p;
+  size_t n = 0;
+  int star;
+
+  for (p=conv->start; p<conv->modifier && n<size-1; p++) {
+    if (*p != '*') {
+      spec[n++] = *p;
+      continue;
+    }
+    if (!get_arg(args, args_length, offset, &star, sizeof(star))) {
+      return false;
+    }
+    if (p[-1] == '.' && star < 0) {
+      n--;    // a negative precision is taken as if it were omitted
+    } else {
+      n += SNPRINTF(&spec[n], size - n, "%d", star);
+    }
+  }
+  if (n + 4 > size) {
+    return false;
+  }
+  if (conv->arg == ARG_INT && conv->shorts) {
+    modifier = conv->shorts > 1 ? "hh" : "h";
+  } else if (conv->arg < sizeof(modifiers) / sizeof(modifiers[0])) {
+    modifier = modifiers[conv->arg];
+  }
+  if (modifier) {
+    strcpy(&spec[n], modifier);
+    n += strlen(modifier);
+  }
+  spec[n++] = conv->conversion;
+  spec[n] = '\0';
+  return true;
+}
+
+// format fmt into msg, taking the arguments from args as stored by pack_args
+static size_t render_args(char *msg, size_t length, const char *fmt,
+                          const uint8_t *args, size_t args_length) {
+  char spec[32];
+  conversion_t conv;
+  size_t offset = 0;
+  size_t n = 0;
+  int written = 0;
+
+  while (*fmt && n < length - 1) {
+    if (*fmt != '%') {
+      msg[n++] = *fmt++;
+      continue;
+    }
+    parse_conversion(fmt, &conv);
+    fmt = conv.end;
+    if (conv.arg == ARG_NONE) {
+      if (conv.conversion == '%') {
+        msg[n++] = '%';
+      }
+      continue;
+    }
+    if (!build_spec(spec, sizeof(spec), &conv, args, args_length, &offset)) {
+      break;
+    }
+    switch (conv.arg) {
+      case ARG_INT: {
+        int value;
+        if (!get_arg(args, args_length, &offset, &value, sizeof(value))) goto done;
+        written = SNPRINTF(&msg[n], length - n, spec, value);
+        break;
+      }
+      case ARG_LONG: {
+        long value;
+        if (!get_arg(args, args_length, &offset, &value, sizeof(value))) goto done;
+        written = SNPRINTF(&msg[n], length - n, spec, value);
+        break;
+      }
+      case ARG_LLONG: {
+        long long value;
+        if (!get_arg(args, args_length, &offset, &value, sizeof(value))) goto done;
+        written = SNPRINTF(&msg[n], length - n, spec, value);
+        break;
+      }
+      case ARG_DOUBLE: {
+        double value;
+        if (!get_arg(args, args_length, &offset, &value, sizeof(value))) goto done;
+        written = SNPRINTF(&msg[n], length - n, spec, value);
+        break;
+      }
+      case ARG_LDOUBLE: {
+        long double value;
+        if (!get_arg(args, args_length, &offset, &value, sizeof(value))) goto done;
+        written = SNPRINTF(&msg[n], length - n, spec, value);
+        break;
+      }
+      case ARG_POINTER: {
+        void *value;
+        if (!get_arg(args, args_length, &offset, &value, sizeof(value))) goto done;
+        written = SNPRINTF(&msg[n], length - n, spec, value);
+        break;
+      }
+      case ARG_STRING: {
+        const char *value = (const char *)&args[offset];
+        if (offset >= args_length) goto done;
+        offset += strlen(value) + 1;
+        written = SNPRINTF(&msg[n], length - n, spec, value);
+        break;
+      }
+      default:
+        written = 0;
+        break;
+    }
+    if (written > 0) {
+      n += (size_t)written < length - n ? (size_t)written : length - n - 1;
+    }
+  }
+done:
+  msg[n] = '\0';
+  return n;
+}
+
+// unpack the field at offset in args packed by pack_fields(), returning
+// false at the end
+static bool get_field(const uint8_t *args, size_t args_length, size_t *offset,
+                      picolog_field_t *field) {
+  uint8_t type;
+  if (!get_arg(args, args_length, offset, &type, sizeof(type)) ||
+      !get_arg(args, args_length, offset, &field->key, sizeof(field->key))) {
+    return false;
+  }
+  field->type = (picolog_field_type_t)type;
+  switch (field->type) {
+    case PICOLOG_FIELD_I32:
+    case PICOLOG_FIELD_U32:
+      return get_arg(args, args_length, offset, &field->value.u32, sizeof(field->value.u32));
+    case PICOLOG_FIELD_I64:
+      return get_arg(args, args_length, offset, &field->value.i64, sizeof(field->value.i64));
+    case PICOLOG_FIELD_FLOAT:
+      return get_arg(args, args_length, offset, &field->value.f, sizeof(field->value.f));
+    case PICOLOG_FIELD_BOOL: {
+      uint8_t value;
+      if (!get_arg(args, args_length, offset, &value, sizeof(value))) {
+        return false;
+      }
+      field->value.u32 = value;
+      return true;
+    }
+    case PICOLOG_FIELD_STR:
+      if (*offset >= args_length) {
+        return false;
+      }
+      field->value.str = (const char *)&args[*offset];
+      *offset += strlen(field->value.str) + 1;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// render a structured message as "event key=value key=value"
+static size_t render_fields(char *msg, size_t length, const char *event,
+                            const uint8_t *args, size_t args_length) {
+  picolog_field_t field;
+  size_t offset = 0;
+  size_t n = 0;
+  int written = SNPRINTF(msg, length, "%s", event);
+
+  while (written >= 0 && (n += written) < length - 1 &&
+         get_field(args, args_length, &offset, &field)) {
+    switch (field.type) {
+      case PICOLOG_FIELD_I32:
+        written = SNPRINTF(&msg[n], length - n, " %s=%ld", field.key, (long)field.value.i32);
+        break;
+      case PICOLOG_FIELD_U32:
+        written = SNPRINTF(&msg[n], length - n, " %s=%lu", field.key,
+                           (unsigned long)field.value.u32);
+        break;
+      case PICOLOG_FIELD_I64:
+        written = SNPRINTF(&msg[n], length - n, " %s=%lld", field.key,
+                           (long long)field.value.i64);
+        break;
+      case PICOLOG_FIELD_FLOAT:
+        written = SNPRINTF(&msg[n], length - n, " %s=%g", field.key, (double)field.value.f);
+        break;
+      case PICOLOG_FIELD_BOOL:
+        written = SNPRINTF(&msg[n], length - n, " %s=%s", field.key,
+                           field.value.u32 ? "true" : "false");
+        break;
+      case PICOLOG_FIELD_STR:
+        written = SNPRINTF(&msg[n], length - n, " %s=%s", field.key, field.value.str);
+        break;
+    }
+  }
+  if (n > length - 1) {
+    n = length - 1;
+  }
+  msg[n] = '\0';
+  return n;
+}
+
+// format record's packed arguments or fields into msg.  Text that fills msg
+// is counted as truncated, since that is where rendering stops.
+static size_t render_text(char *msg, size_t length, const record_t *record) {
+  size_t n;
+  if (record->structured) {
+    n = render_fields(msg, length, record->fmt, record->args, record->args_length);
+  } else {
+    n = render_args(msg, length, record->fmt, record->args, record->args_length);
+  }
+  STAT_ADD(bytes_formatted, n);
+  if (n + 1 >= length) {
+    STAT_ADD(truncated, 1);
+  }
+  return n;
+}
+
+// picolog_trigger() with the time already read, as the low 32 bits of
+// time_us_64(), for the messages that open the window
+static void trigger_at(uint32_t now, uint32_t duration_us) {
+  uint32_t until = now + duration_us;
+  if (!picolog_trigger_armed || (int32_t)(until - s_trigger_until) > 0) {
+    s_trigger_until = until;
+  }
+  picolog_trigger_armed = true;
+}
+
+#ifdef PICOLOG_NO_ANSI
+#define NORMAL  ""
+#define RED     ""
+#define GREEN   ""
+#define YELLOW  ""
+#define BLUE    ""
+#define MAGENTA ""
+#define CYAN    ""
+#define WHITE   ""
+#else
 #define NORMAL  "\x1B[0m"
 #define RED     "\x1B[31m"
 #define GREEN   "\x1B[32m"
@@ -137,31 +2217,67 @@ void picolog_message(picolog_level_t severity, const char *fmt, ...) {
 #define MAGENTA "\x1B[35m"
 #define CYAN    "\x1B[36m"
 #define WHITE   "\x1B[37m"
+#endif
+
+// the start and end of each line picolog_format() prints, worked out at
+// compile time so that a line is put together with three memcpy()s
+typedef struct {
+  const char *text;
+  uint8_t length;
+} prefix_t;
+
+#define PREFIX(colour, name) { colour "[" name "] ", sizeof(colour "[" name "] ") - 1 }
+#define SUFFIX " " NORMAL "\n"
+#define SUFFIX_LENGTH (sizeof(SUFFIX) - 1)
+
+static const prefix_t s_prefixes[LEVEL_COUNT] = {
+  PREFIX(NORMAL, "TRACE"),
+  PREFIX(WHITE, "DEBUG"),
+  PREFIX(GREEN, "INFO"),
+  PREFIX(YELLOW, "WARNING"),
+  PREFIX(RED, "ERROR"),
+  PREFIX(MAGENTA, "CRITICAL"),
+  PREFIX(BLUE, "ALWAYS"),
+};
+
+// longest line: the longest prefix, a message and the suffix
+#define MAX_LINE_LENGTH \
+  (sizeof(MAGENTA "[CRITICAL] ") - 1 + PICOLOG_MAX_MESSAGE_LENGTH + SUFFIX_LENGTH)
 
+// print the message to stdout in colour, as one write
 void picolog_format(picolog_level_t severity, char *msg) {
-	switch(severity) {   
-    case PICOLOG_ALWAYS_LEVEL:
-      printf("%s[%s] %s %s\n", BLUE, picolog_level_name(severity), msg, NORMAL);
-      break;
-    case PICOLOG_CRITICAL_LEVEL:
-      printf("%s[%s] %s %s\n", MAGENTA, picolog_level_name(severity), msg, NORMAL);
-      break;
-    case PICOLOG_ERROR_LEVEL:
-      printf("%s[%s] %s %s\n", RED, picolog_level_name(severity), msg, NORMAL);
-      break;
-    case PICOLOG_WARNING_LEVEL:
-      printf("%s[%s] %s %s\n", YELLOW, picolog_level_name(severity), msg, NORMAL);
-      break;
-    case PICOLOG_INFO_LEVEL:
-      printf("%s[%s] %s %s\n", GREEN, picolog_level_name(severity), msg, NORMAL);
-      break;	
-    case PICOLOG_DEBUG_LEVEL:
-      printf("%s[%s] %s %s\n", WHITE, picolog_level_name(severity), msg, NORMAL);
-      break;	
-    case PICOLOG_TRACE_LEVEL:
-      printf("%s[%s] %s %s\n", NORMAL, picolog_level_name(severity), msg, NORMAL);
-      break;
-	}
+  char line[MAX_LINE_LENGTH + 1];
+  size_t length = picolog_format_line(line, sizeof(line), severity, msg);
+  if (length > 0) {
+    fwrite(line, 1, length, stdout);
+  }
+}
+
+// write the line picolog_format() would print into line, for subscribers that
+// send it somewhere other than stdout.  Returns the length of the line, which
+// has its message truncated (but is still newline terminated) if it doesn't
+// fit, or 0 if line is too short even for that.
+size_t picolog_format_line(char *line, size_t length, picolog_level_t severity,
+                           const char *msg) {
+  const prefix_t *prefix;
+  size_t msg_length, n;
+  if (severity < PICOLOG_TRACE_LEVEL || severity > PICOLOG_ALWAYS_LEVEL) {
+    return 0;
+  }
+  prefix = &s_prefixes[severity - PICOLOG_TRACE_LEVEL];
+  if (length < prefix->length + SUFFIX_LENGTH + 1) {
+    return 0;
+  }
+  msg_length = strlen(msg);
+  if (msg_length > length - prefix->length - SUFFIX_LENGTH - 1) {
+    msg_length = length - prefix->length - SUFFIX_LENGTH - 1;
+  }
+  memcpy(line, prefix->text, prefix->length);
+  n = prefix->length;
+  memcpy(&line[n], msg, msg_length);
+  n += msg_length;
+  memcpy(&line[n], SUFFIX, SUFFIX_LENGTH + 1);
+  return n + SUFFIX_LENGTH;
 }
 
 #endif  // #ifdef PICOLOG_ENABLED
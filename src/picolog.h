@@ -36,11 +36,12 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  *     // the message.  This example prints to the console.  One caveat: msg
  *     // is a static string and will be over-written at the next call to PICOLOG.
  *     // You may print it or copy it, but saving a pointer to it will lead to
- *     // confusion and astonishment.
+ *     // confusion and astonishment.  timestamp is the time_us_64() at which
+ *     // the message was logged, which may be some time before it is delivered.
  *     //
- *     void my_console_logger(picolog_level_t level, const char *msg) {
- *         printf("%s [%s]: %s\n",
- *             get_timestamp(),
+ *     void my_console_logger(picolog_level_t level, uint64_t timestamp, char *msg) {
+ *         printf("%llu [%s]: %s\n",
+ *             (unsigned long long)timestamp,
  *             picolog_level_name(level),
  *             msg);
  *     }
@@ -50,7 +51,7 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  *
  *         // log to the console messages that are WARNING or more severe.  You
  *         // can re-subscribe at any point to change the severity level.
- *         PICOLOG_SUBSCRIBE(my_console_logger, PICOLOG_WARNING);
+ *         PICOLOG_SUBSCRIBE_TIMED(my_console_logger, PICOLOG_WARNING);
  *
  *         // log to a file messages that are DEBUG or more severe
  *         PICOLOG_SUBSCRIBE(my_file_logger, PICOLOG_DEBUG);
@@ -68,6 +69,9 @@ extern "C" {
     #endif
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 typedef enum {
   PICOLOG_TRACE_LEVEL=100,
@@ -79,6 +83,42 @@ typedef enum {
   PICOLOG_ALWAYS_LEVEL
 } picolog_level_t;
 
+// a set of levels, one bit per level, for subscribers that take something
+// other than every level from a threshold up
+typedef uint8_t picolog_levels_t;
+#define PICOLOG_LEVEL_BIT(level) ((picolog_levels_t)(1u << ((level) - PICOLOG_TRACE_LEVEL)))
+#define PICOLOG_LEVEL_COUNT (PICOLOG_ALWAYS_LEVEL - PICOLOG_TRACE_LEVEL + 1)
+#define PICOLOG_ALL_LEVELS ((picolog_levels_t)(PICOLOG_LEVEL_BIT(PICOLOG_ALWAYS_LEVEL) * 2 - 1))
+// the set of levels a threshold admits: threshold and everything above it
+#define PICOLOG_LEVELS_FROM(threshold) \
+  ((threshold) <= PICOLOG_TRACE_LEVEL ? PICOLOG_ALL_LEVELS : \
+   (threshold) > PICOLOG_ALWAYS_LEVEL ? (picolog_levels_t)0 : \
+   (picolog_levels_t)(PICOLOG_ALL_LEVELS & ~(PICOLOG_LEVEL_BIT(threshold) - 1)))
+
+// A channel tags the messages of one module so that its detail can be
+// raised or lowered on its own.  Define one per module with
+//
+//     PICOLOG_CHANNEL_DEFINE(radio_log, "radio", PICOLOG_INFO_LEVEL);
+//
+// (and PICOLOG_CHANNEL_DECLARE(radio_log) in a header if other files log to
+// it), then log with PICOLOG_CH_DEBUG(radio_log, ...) and so on.  Messages
+// below the channel's threshold are skipped inline, before their arguments
+// are evaluated; the threshold may be changed at any time with
+// PICOLOG_CHANNEL_SET(radio_log, PICOLOG_DEBUG_LEVEL).  A subscriber can be
+// limited to one channel with picolog_subscriber_channel().  A channel
+// registered with PICOLOG_CHANNEL_REGISTER(radio_log) can also be found by
+// name, e.g. by the "set radio debug" command of picolog_control.h.
+typedef struct picolog_channel {
+  const char *name;
+  volatile picolog_level_t threshold;
+  struct picolog_channel *next;    // the next registered channel
+} picolog_channel_t;
+
+#define PICOLOG_CHANNEL_DEFINE(var, name, threshold) \
+  picolog_channel_t var = { name, threshold, NULL }
+#define PICOLOG_CHANNEL_DECLARE(var) extern picolog_channel_t var
+#define PICOLOG_CHANNEL_SET(var, level) ((var).threshold = (level))
+
 // The following macros enable or disable picolog.  If `PICOLOG_ENABLED` is
 // defined at compile time, a macro such as `PICOLOG_INFO(...)` expands
 // into `picolog_message(PICOLOG_INFO_LEVEL, ...)`.  If `PICOLOG_ENABLED` is not
@@ -90,25 +130,209 @@ typedef enum {
 // your compiler switches.
 #define PICOLOG_ENABLED
 
+// If `PICOLOG_DEFERRED` is defined, a call such as `PICOLOG_INFO(...)` does
+// not format its message on the spot.  Instead it copies the severity, the
+// fmt pointer, a timestamp and the raw arguments into a preallocated queue,
+// and the formatting and delivery to subscribers happens later, when the
+// application calls `PICOLOG_FLUSH()` (typically from its main loop).  Since
+// fmt is stored as a pointer it must be a string literal (or otherwise live
+// for the lifetime of the program); strings passed for `%s` are copied into
+// the queue.  Like `PICOLOG_ENABLED` it may be uncommented here or given as
+// -DPICOLOG_DEFERRED on the command line.
+// #define PICOLOG_DEFERRED
+
+// If `PICOLOG_DRAIN_CORE1` is defined as well, picolog_init() launches a drain
+// loop on core1 that sleeps until a message is queued and then does all of
+// the formatting and calls every subscriber, so logging costs the caller no
+// more than the enqueue and there is no need to call `PICOLOG_FLUSH()`.  This
+// mode implies `PICOLOG_DEFERRED`, takes over core1 and needs pico_multicore:
+// linking against the `picolog_core1` library instead of `picolog` sets all
+// of this up.
+// #define PICOLOG_DRAIN_CORE1
+
+#if defined(PICOLOG_DRAIN_CORE1) && !defined(PICOLOG_DEFERRED)
+#define PICOLOG_DEFERRED
+#endif
+
+// If `PICOLOG_BUILTIN_PRINTF` is defined, messages are formatted with
+// picolog_vsnprintf() (see picolog_printf.c) rather than newlib's vsnprintf.
+// It handles the conversions log messages use -- integers, strings, chars,
+// pointers and %f/%e/%g -- in a fraction of the time and without pulling in
+// newlib's printf, but is not a complete implementation: floating point
+// digits past the 24th significant one are zeros, halfway cases round away
+// from zero and %n is ignored.
+// #define PICOLOG_BUILTIN_PRINTF
+
+// If `PICOLOG_NO_ANSI` is defined, picolog_format() and picolog_format_line()
+// leave out the ANSI colour codes, and picolog_init() doesn't clear the
+// screen, for links where the bytes matter more than the colours.
+// #define PICOLOG_NO_ANSI
+
+// If `PICOLOG_RATE_LIMIT` is defined, each call site -- identified by its
+// format string -- may log a burst of `PICOLOG_RATE_LIMIT_BURST` messages and
+// after that one per `PICOLOG_RATE_LIMIT_INTERVAL_US`, so that a fault which
+// logs the same error thousands of times a second can't swamp the output.
+// The check is made before the message is formatted or queued.  The next
+// message a site logs after some were suppressed is preceded by one saying
+// how many -- or if the site has gone quiet, picolog_flush() logs it once
+// the interval is up, so call that now and then even in immediate mode --
+// and picolog_suppressed() returns the total.
+// #define PICOLOG_RATE_LIMIT
+
+// If `PICOLOG_STATS` is defined, picolog counts what it does -- messages
+// logged at each level, messages that nobody wanted, characters formatted,
+// messages cut short at PICOLOG_MAX_MESSAGE_LENGTH, the time spent in each
+// subscriber and the most the deferred queue has held -- and
+// picolog_get_stats() returns the counts.  They are kept with relaxed atomic
+// loads and stores rather than a lock, which costs a few instructions per
+// message but means that a count made on both cores at the same moment may
+// be lost now and then.  Without it the counters are not compiled at all.
+// #define PICOLOG_STATS
+
+// `PICOLOG_COMPILE_LEVEL` sets a floor below which the level macros are
+// compiled out, e.g. -DPICOLOG_COMPILE_LEVEL=PICOLOG_INFO_LEVEL removes every
+// `PICOLOG_TRACE(...)` and `PICOLOG_DEBUG(...)` from a release build.  Unlike
+// disabling picolog altogether the stripped calls are still type-checked,
+// but their arguments are not evaluated and their format strings take up no
+// flash.  `PICOLOG(...)` takes its level at run time and is never stripped.
+#ifndef PICOLOG_COMPILE_LEVEL
+#define PICOLOG_COMPILE_LEVEL PICOLOG_TRACE_LEVEL
+#endif
+
 #ifdef PICOLOG_ENABLED
   #define PICOLOG_INIT(a) picolog_init(a)
   #define PICOLOG_SUBSCRIBE(a, b) picolog_subscribe(a, b)
+  #define PICOLOG_SUBSCRIBE_MASK(a, b) picolog_subscribe_mask(a, b)
   #define PICOLOG_UNSUBSCRIBE(a) picolog_unsubscribe(a)
+  #define PICOLOG_SUBSCRIBE_TIMED(a, b) picolog_subscribe_timed(a, b)
+  #define PICOLOG_SUBSCRIBE_TIMED_MASK(a, b) picolog_subscribe_timed_mask(a, b)
+  #define PICOLOG_UNSUBSCRIBE_TIMED(a) picolog_unsubscribe_timed(a)
+  #define PICOLOG_SUBSCRIBE_RECORD(a, b) picolog_subscribe_record(a, b)
+  #define PICOLOG_SUBSCRIBE_RECORD_MASK(a, b) picolog_subscribe_record_mask(a, b)
+  #define PICOLOG_UNSUBSCRIBE_RECORD(a) picolog_unsubscribe_record(a)
+  #define PICOLOG_SUBSCRIBE_RECORD_ARGS(a, b) picolog_subscribe_record_args(a, b)
+  #define PICOLOG_SUBSCRIBE_RECORD_ARGS_MASK(a, b) picolog_subscribe_record_args_mask(a, b)
+  #define PICOLOG_SUBSCRIBE_BINARY(a, b) picolog_subscribe_binary(a, b)
+  #define PICOLOG_SUBSCRIBE_BINARY_MASK(a, b) picolog_subscribe_binary_mask(a, b)
+  #define PICOLOG_UNSUBSCRIBE_BINARY(a) picolog_unsubscribe_binary(a)
+  #define PICOLOG_SUBSCRIBE_BATCH(a, b) picolog_subscribe_batch(a, b)
+  #define PICOLOG_SUBSCRIBE_BATCH_MASK(a, b) picolog_subscribe_batch_mask(a, b)
+  #define PICOLOG_UNSUBSCRIBE_BATCH(a) picolog_unsubscribe_batch(a)
+  #define PICOLOG_SUBSCRIBE_BATCH_TEXT(a, b) picolog_subscribe_batch_text(a, b)
+  #define PICOLOG_SUBSCRIBE_BATCH_TEXT_MASK(a, b) picolog_subscribe_batch_text_mask(a, b)
+  #define PICOLOG_SUBSCRIBER_CHANNEL(a, b) \
+    picolog_subscriber_channel((picolog_any_function_t)(a), b)
+  #define PICOLOG_SUBSCRIBER_QUEUED(a, b) \
+    picolog_subscriber_queued((picolog_any_function_t)(a), b)
+  #define PICOLOG_SUBSCRIBER_THRESHOLD(a, b) \
+    picolog_subscriber_threshold((picolog_any_function_t)(a), b)
+  #define PICOLOG_CHANNEL_REGISTER(var) picolog_register_channel(&(var))
   #define PICOLOG_LEVEL_NAME(a) picolog_level_name(a)
+  #define PICOLOG_FLUSH() picolog_flush()
+  #define PICOLOG_FLUSH_QUEUED() picolog_flush_queued()
   #define PICOLOG(...) picolog_message(__VA_ARGS__)
-  #define PICOLOG_TRACE(...) picolog_message(PICOLOG_TRACE_LEVEL, __VA_ARGS__)
-  #define PICOLOG_DEBUG(...) picolog_message(PICOLOG_DEBUG_LEVEL, __VA_ARGS__)
-  #define PICOLOG_INFO(...) picolog_message(PICOLOG_INFO_LEVEL, __VA_ARGS__)
-  #define PICOLOG_WARNING(...) picolog_message(PICOLOG_WARNING_LEVEL, __VA_ARGS__)
-  #define PICOLOG_ERROR(...) picolog_message(PICOLOG_ERROR_LEVEL, __VA_ARGS__)
-  #define PICOLOG_CRITICAL(...) picolog_message(PICOLOG_CRITICAL_LEVEL, __VA_ARGS__)
-  #define PICOLOG_ALWAYS(...) picolog_message(PICOLOG_ALWAYS_LEVEL, __VA_ARGS__)
+  #define PICOLOG_TRACE(...) PICOLOG_MESSAGE_(PICOLOG_TRACE_LEVEL, __VA_ARGS__)
+  #define PICOLOG_DEBUG(...) PICOLOG_MESSAGE_(PICOLOG_DEBUG_LEVEL, __VA_ARGS__)
+  #define PICOLOG_INFO(...) PICOLOG_MESSAGE_(PICOLOG_INFO_LEVEL, __VA_ARGS__)
+  #define PICOLOG_WARNING(...) PICOLOG_MESSAGE_(PICOLOG_WARNING_LEVEL, __VA_ARGS__)
+  #define PICOLOG_ERROR(...) PICOLOG_MESSAGE_(PICOLOG_ERROR_LEVEL, __VA_ARGS__)
+  #define PICOLOG_CRITICAL(...) PICOLOG_MESSAGE_(PICOLOG_CRITICAL_LEVEL, __VA_ARGS__)
+  #define PICOLOG_ALWAYS(...) PICOLOG_MESSAGE_(PICOLOG_ALWAYS_LEVEL, __VA_ARGS__)
+  // the test against PICOLOG_COMPILE_LEVEL is constant, so the compiler
+  // discards the call (and its arguments) when it fails.  The test against
+  // picolog_min_threshold skips the call, and the evaluation of its
+  // arguments, when no subscriber would receive the message.
+  #define PICOLOG_MESSAGE_(level, ...) do { \
+    if ((level) >= PICOLOG_COMPILE_LEVEL && (level) >= picolog_min_threshold) \
+      PICOLOG_CALL_(level, __VA_ARGS__); \
+  } while(0)
+  #define PICOLOG_CALL_(level, ...) picolog_message(level, __VA_ARGS__)
+  // Sampled logging, for call sites too busy to log every time they run,
+  // such as a 10 kHz control loop.  Each takes the level first, e.g.
+  //
+  //     PICOLOG_EVERY_N(1000, PICOLOG_DEBUG_LEVEL, "i=%d", current);
+  //
+  // and like the level macros skips the message, arguments and all, if no
+  // subscriber takes the level; only then is the sampling test made, so a
+  // disabled call site costs no more than before.
+  //
+  // PICOLOG_EVERY_N logs the first hit and then one in every n, counting
+  // with a static countdown of its own (so no division); an n of 1 or less,
+  // e.g. 0 from a configuration, logs every hit.  The count is not atomic:
+  // hits on both cores at once may be counted once.
+  #define PICOLOG_EVERY_N(n, level, ...) do { \
+    static uint32_t picolog_countdown_; \
+    if ((level) >= PICOLOG_COMPILE_LEVEL && (level) >= picolog_min_threshold && \
+        picolog_countdown_-- == 0) { \
+      picolog_countdown_ = (n) > 1 ? (uint32_t)(n) - 1 : 0; \
+      PICOLOG_CALL_(level, __VA_ARGS__); \
+    } \
+  } while(0)
+  // PICOLOG_SAMPLED logs each hit with probability p, from 0.0 to 1.0, by
+  // drawing from picolog_random().  p should be a constant, so that scaling
+  // it takes no floating point at run time.
+  #define PICOLOG_SAMPLED(p, level, ...) do { \
+    if ((level) >= PICOLOG_COMPILE_LEVEL && (level) >= picolog_min_threshold && \
+        picolog_random() <= (uint32_t)((p) * 4294967295.0)) \
+      PICOLOG_CALL_(level, __VA_ARGS__); \
+  } while(0)
+  // PICOLOG_TRIGGERED logs only while the trigger window is open: for
+  // PICOLOG_TRIGGER_WINDOW_US after any message at PICOLOG_TRIGGER_LEVEL or
+  // above, or for as long as picolog_trigger() says, so the detail leading
+  // on from a fault is kept.  Outside the window the test is one load.
+  #define PICOLOG_TRIGGERED(level, ...) do { \
+    if ((level) >= PICOLOG_COMPILE_LEVEL && (level) >= picolog_min_threshold && \
+        picolog_trigger_armed && picolog_trigger_active()) \
+      PICOLOG_CALL_(level, __VA_ARGS__); \
+  } while(0)
+  #define PICOLOG_CH_TRACE(ch, ...) PICOLOG_CH_MESSAGE_(ch, PICOLOG_TRACE_LEVEL, __VA_ARGS__)
+  #define PICOLOG_CH_DEBUG(ch, ...) PICOLOG_CH_MESSAGE_(ch, PICOLOG_DEBUG_LEVEL, __VA_ARGS__)
+  #define PICOLOG_CH_INFO(ch, ...) PICOLOG_CH_MESSAGE_(ch, PICOLOG_INFO_LEVEL, __VA_ARGS__)
+  #define PICOLOG_CH_WARNING(ch, ...) PICOLOG_CH_MESSAGE_(ch, PICOLOG_WARNING_LEVEL, __VA_ARGS__)
+  #define PICOLOG_CH_ERROR(ch, ...) PICOLOG_CH_MESSAGE_(ch, PICOLOG_ERROR_LEVEL, __VA_ARGS__)
+  #define PICOLOG_CH_CRITICAL(ch, ...) PICOLOG_CH_MESSAGE_(ch, PICOLOG_CRITICAL_LEVEL, __VA_ARGS__)
+  #define PICOLOG_CH_ALWAYS(ch, ...) PICOLOG_CH_MESSAGE_(ch, PICOLOG_ALWAYS_LEVEL, __VA_ARGS__)
+  #define PICOLOG_CH_MESSAGE_(ch, level, ...) do { \
+    if ((level) >= PICOLOG_COMPILE_LEVEL && (level) >= (ch).threshold && \
+        (level) >= picolog_min_threshold) \
+      picolog_channel_message(&(ch), level, __VA_ARGS__); \
+  } while(0)
+  #define PICOLOG_KV(level, event, ...) do { \
+    if ((level) >= PICOLOG_COMPILE_LEVEL && (level) >= picolog_min_threshold) { \
+      const picolog_field_t picolog_fields_[] = { __VA_ARGS__ }; \
+      picolog_kv(level, event, picolog_fields_, \
+                 sizeof(picolog_fields_) / sizeof(picolog_fields_[0])); \
+    } \
+  } while(0)
 #else
   // picolog vanishes when disabled at compile time...
   #define PICOLOG_INIT(a) do {} while(0)
   #define PICOLOG_SUBSCRIBE(a, b) do {} while(0)
+  #define PICOLOG_SUBSCRIBE_MASK(a, b) do {} while(0)
   #define PICOLOG_UNSUBSCRIBE(a) do {} while(0)
+  #define PICOLOG_SUBSCRIBE_TIMED(a, b) do {} while(0)
+  #define PICOLOG_SUBSCRIBE_TIMED_MASK(a, b) do {} while(0)
+  #define PICOLOG_UNSUBSCRIBE_TIMED(a) do {} while(0)
+  #define PICOLOG_SUBSCRIBE_RECORD(a, b) do {} while(0)
+  #define PICOLOG_SUBSCRIBE_RECORD_MASK(a, b) do {} while(0)
+  #define PICOLOG_UNSUBSCRIBE_RECORD(a) do {} while(0)
+  #define PICOLOG_SUBSCRIBE_RECORD_ARGS(a, b) do {} while(0)
+  #define PICOLOG_SUBSCRIBE_RECORD_ARGS_MASK(a, b) do {} while(0)
+  #define PICOLOG_SUBSCRIBE_BINARY(a, b) do {} while(0)
+  #define PICOLOG_SUBSCRIBE_BINARY_MASK(a, b) do {} while(0)
+  #define PICOLOG_UNSUBSCRIBE_BINARY(a) do {} while(0)
+  #define PICOLOG_SUBSCRIBE_BATCH(a, b) do {} while(0)
+  #define PICOLOG_SUBSCRIBE_BATCH_MASK(a, b) do {} while(0)
+  #define PICOLOG_UNSUBSCRIBE_BATCH(a) do {} while(0)
+  #define PICOLOG_SUBSCRIBE_BATCH_TEXT(a, b) do {} while(0)
+  #define PICOLOG_SUBSCRIBE_BATCH_TEXT_MASK(a, b) do {} while(0)
+  #define PICOLOG_SUBSCRIBER_CHANNEL(a, b) do {} while(0)
+  #define PICOLOG_SUBSCRIBER_QUEUED(a, b) do {} while(0)
+  #define PICOLOG_SUBSCRIBER_THRESHOLD(a, b) do {} while(0)
+  #define PICOLOG_CHANNEL_REGISTER(var) do {} while(0)
   #define PICOLOG_LEVEL_NAME(a) do {} while(0)
+  #define PICOLOG_FLUSH() do {} while(0)
+  #define PICOLOG_FLUSH_QUEUED() do {} while(0)
   #define PICOLOG(s, f, ...) do {} while(0)
   #define PICOLOG_TRACE(f, ...) do {} while(0)
   #define PICOLOG_DEBUG(f, ...) do {} while(0)
@@ -117,14 +341,56 @@ typedef enum {
   #define PICOLOG_ERROR(f, ...) do {} while(0)
   #define PICOLOG_CRITICAL(f, ...) do {} while(0)
   #define PICOLOG_ALWAYS(f, ...) do {} while(0)
+  #define PICOLOG_CH_TRACE(ch, f, ...) do {} while(0)
+  #define PICOLOG_CH_DEBUG(ch, f, ...) do {} while(0)
+  #define PICOLOG_CH_INFO(ch, f, ...) do {} while(0)
+  #define PICOLOG_CH_WARNING(ch, f, ...) do {} while(0)
+  #define PICOLOG_CH_ERROR(ch, f, ...) do {} while(0)
+  #define PICOLOG_CH_CRITICAL(ch, f, ...) do {} while(0)
+  #define PICOLOG_CH_ALWAYS(ch, f, ...) do {} while(0)
+  #define PICOLOG_KV(level, event, ...) do {} while(0)
+  #define PICOLOG_EVERY_N(n, level, ...) do {} while(0)
+  #define PICOLOG_SAMPLED(p, level, ...) do {} while(0)
+  #define PICOLOG_TRIGGERED(level, ...) do {} while(0)
 #endif
 
 typedef enum {
   PICOLOG_ERR_NONE = 0,
   PICOLOG_ERR_SUBSCRIBERS_EXCEEDED,
   PICOLOG_ERR_NOT_SUBSCRIBED,
+  PICOLOG_ERR_INVALID_ARGUMENT,
+  PICOLOG_ERR_QUEUES_EXCEEDED,
 } picolog_err_t;
 
+// rate limiter settings (see PICOLOG_RATE_LIMIT): the number of call sites
+// tracked at once, and the burst and sustained rate each is allowed
+#ifndef PICOLOG_RATE_LIMIT_SITES
+#define PICOLOG_RATE_LIMIT_SITES 16
+#endif
+#ifndef PICOLOG_RATE_LIMIT_BURST
+#define PICOLOG_RATE_LIMIT_BURST 5
+#endif
+#ifndef PICOLOG_RATE_LIMIT_INTERVAL_US
+#define PICOLOG_RATE_LIMIT_INTERVAL_US 100000
+#endif
+
+// the window PICOLOG_TRIGGERED() logs in: opened for
+// PICOLOG_TRIGGER_WINDOW_US, at most 2^31 - 1, by each message at
+// PICOLOG_TRIGGER_LEVEL or above
+#ifndef PICOLOG_TRIGGER_LEVEL
+#define PICOLOG_TRIGGER_LEVEL PICOLOG_ERROR_LEVEL
+#endif
+#ifndef PICOLOG_TRIGGER_WINDOW_US
+#define PICOLOG_TRIGGER_WINDOW_US 100000
+#endif
+
+// the clock the time spent in subscribers is measured with (see
+// PICOLOG_STATS): microseconds by default, but any 32 bit counter that
+// counts up will do
+#ifndef PICOLOG_STATS_CLOCK
+#define PICOLOG_STATS_CLOCK() time_us_32()
+#endif
+
 // define the maximum number of concurrent subscribers
 #ifndef PICOLOG_MAX_SUBSCRIBERS
 #define PICOLOG_MAX_SUBSCRIBERS 6
@@ -133,17 +399,295 @@ typedef enum {
 #ifndef PICOLOG_MAX_MESSAGE_LENGTH
 #define PICOLOG_MAX_MESSAGE_LENGTH 120
 #endif
+// number of messages that may be logged at once on each core, each needing
+// its own PICOLOG_MAX_MESSAGE_LENGTH + PICOLOG_MAX_FRAME_LENGTH bytes of
+// scratch space: one, plus one for each level of interrupt handler or
+// subscriber that logs while another message is being delivered.  In
+// immediate mode a message logged deeper than this is dropped.
+#ifndef PICOLOG_SCRATCH_DEPTH
+#define PICOLOG_SCRATCH_DEPTH 2
+#endif
+// bytes of RAM given to the deferred queue, a power of two.  Each message
+// takes a 31 byte header and its packed arguments, rounded up to a word, so
+// one with an int or two takes 36 or 40 bytes and 2048 bytes hold 51 to 56
+// of them.  The queue may be written from both cores and from interrupt
+// handlers, but must only be drained from one place at a time (see
+// picolog_flush()).
+#ifndef PICOLOG_QUEUE_SIZE
+#define PICOLOG_QUEUE_SIZE 2048
+#endif
+// the most messages, and bytes of their text, that the drain collects for
+// batch subscribers before passing them on.  The text is only kept for
+// those subscribed with picolog_subscribe_batch_text().
+#ifndef PICOLOG_BATCH_LENGTH
+#define PICOLOG_BATCH_LENGTH 8
+#endif
+#ifndef PICOLOG_BATCH_TEXT_SIZE
+#define PICOLOG_BATCH_TEXT_SIZE 512
+#endif
+// the number of deferred subscribers that may have a queue of their own
+// (see picolog_subscriber_queued()), and the messages each queue holds, a
+// power of two.  Each message takes PICOLOG_MAX_ARGS_LENGTH + 32 bytes or so.
+#ifndef PICOLOG_SUBSCRIBER_QUEUES
+#define PICOLOG_SUBSCRIBER_QUEUES 2
+#endif
+#ifndef PICOLOG_SUBSCRIBER_QUEUE_LENGTH
+#define PICOLOG_SUBSCRIBER_QUEUE_LENGTH 16
+#endif
+// what happens to a deferred message that finds the queue full:
+//   PICOLOG_OVERFLOW_DROP_NEWEST: the new message is dropped (the default)
+//   PICOLOG_OVERFLOW_OVERWRITE_OLDEST: the oldest queued messages are
+//     dropped to make room, unless one of them is still being written
+//   PICOLOG_OVERFLOW_BLOCK: the caller waits up to PICOLOG_OVERFLOW_TIMEOUT_US
+//     for the drain before dropping the message.  Interrupt handlers never
+//     wait, and a caller on the core that drains with PICOLOG_FLUSH() waits
+//     in vain, so this is mostly useful with PICOLOG_DRAIN_CORE1.
+//   PICOLOG_OVERFLOW_RESERVE: the last PICOLOG_OVERFLOW_RESERVED_BYTES free
+//     bytes are kept for messages at PICOLOG_OVERFLOW_RESERVE_LEVEL or above
+// Lost messages are counted by picolog_overruns() and picolog_dropped(), and
+// the next message delivered is preceded by a WARNING saying how many.
+#define PICOLOG_OVERFLOW_DROP_NEWEST 0
+#define PICOLOG_OVERFLOW_OVERWRITE_OLDEST 1
+#define PICOLOG_OVERFLOW_BLOCK 2
+#define PICOLOG_OVERFLOW_RESERVE 3
+#ifndef PICOLOG_OVERFLOW_POLICY
+#define PICOLOG_OVERFLOW_POLICY PICOLOG_OVERFLOW_DROP_NEWEST
+#endif
+#ifndef PICOLOG_OVERFLOW_TIMEOUT_US
+#define PICOLOG_OVERFLOW_TIMEOUT_US 1000
+#endif
+#ifndef PICOLOG_OVERFLOW_RESERVED_BYTES
+#define PICOLOG_OVERFLOW_RESERVED_BYTES (PICOLOG_QUEUE_SIZE / 4)
+#endif
+#ifndef PICOLOG_OVERFLOW_RESERVE_LEVEL
+#define PICOLOG_OVERFLOW_RESERVE_LEVEL PICOLOG_ERROR_LEVEL
+#endif
+
+// bytes of raw arguments (including copied %s strings) stored per message.
+// A deferred message takes only the queue space its own arguments need, so
+// this can be raised to keep long %s strings whole without costing short
+// messages anything.
+#ifndef PICOLOG_MAX_ARGS_LENGTH
+#define PICOLOG_MAX_ARGS_LENGTH 32
+#endif
+// longest binary frame: a 9 byte header plus the packed arguments, the COBS
+// overhead of one byte per 254 and the zero byte delimiter
+#define PICOLOG_MAX_FRAME_LENGTH \
+  (9 + PICOLOG_MAX_ARGS_LENGTH + (9 + PICOLOG_MAX_ARGS_LENGTH) / 254 + 2)
+
 /**
  * @brief: prototype for picolog subscribers.
  */
 typedef void (*picolog_function_t)(picolog_level_t severity, char *msg);
 
+/**
+ * @brief: prototype for picolog subscribers that want the time of each message.
+ *
+ * timestamp is the time_us_64() value read once, when the message was
+ * logged, rather than when it is delivered (which for deferred messages may
+ * be much later).
+ */
+typedef void (*picolog_timed_function_t)(picolog_level_t severity,
+                                         uint64_t timestamp, char *msg);
+
+/**
+ * @brief: a read-only view of one message, as passed to record subscribers.
+ *
+ * Nothing is copied to build it: args points at the packed arguments and
+ * text at the formatted message, as picolog has them, so a record
+ * subscriber can hand either straight to DMA or a network stack, provided
+ * it is done with them by the time it returns.  text is NUL terminated, but
+ * text_length saves measuring it.
+ */
+typedef struct {
+  picolog_level_t severity;
+  uint64_t timestamp;      // time_us_64() when the message was logged
+  uint32_t sequence;       // increments by one per message; gaps mean drops
+  uint8_t core;            // core that logged the message
+  bool structured;         // logged by PICOLOG_KV(): args holds fields
+  const picolog_channel_t *channel;    // NULL if not logged to a channel
+  const char *fmt;
+  const uint8_t *args;     // arguments packed as for binary frames
+  size_t args_length;
+  const char *text;        // the formatted message, or "" if not wanted
+  size_t text_length;
+} picolog_record_t;
+
+/**
+ * @brief: one typed field of a structured message.
+ *
+ * PICOLOG_KV(level, "event", PL_I32("temp", t), PL_STR("state", name))
+ * logs the fields as they are, with no formatting on the device: a binary
+ * subscriber sends them on in a few bytes each, and a record subscriber
+ * reads them back with picolog_next_field().  The key, like fmt, is stored
+ * as a pointer and must be a string literal.  Text subscribers get
+ * "event temp=21 state=idle".  A field takes 9 bytes of the message's
+ * PICOLOG_MAX_ARGS_LENGTH (a 32 bit one; a string takes 5 plus its length
+ * with its NUL), and fields that don't fit are left out.
+ */
+typedef enum {
+  PICOLOG_FIELD_I32 = 1,
+  PICOLOG_FIELD_U32,
+  PICOLOG_FIELD_I64,
+  PICOLOG_FIELD_FLOAT,
+  PICOLOG_FIELD_BOOL,    // in value.u32
+  PICOLOG_FIELD_STR,     // copied when logged, like a %s argument
+} picolog_field_type_t;
+
+typedef struct {
+  picolog_field_type_t type;
+  const char *key;
+  union {
+    int32_t i32;
+    uint32_t u32;
+    int64_t i64;
+    float f;
+    const char *str;
+  } value;
+} picolog_field_t;
+
+#define PL_I32(key, v) { PICOLOG_FIELD_I32, key, { .i32 = (v) } }
+#define PL_U32(key, v) { PICOLOG_FIELD_U32, key, { .u32 = (v) } }
+#define PL_I64(key, v) { PICOLOG_FIELD_I64, key, { .i64 = (v) } }
+#define PL_FLOAT(key, v) { PICOLOG_FIELD_FLOAT, key, { .f = (v) } }
+#define PL_BOOL(key, v) { PICOLOG_FIELD_BOOL, key, { .u32 = (v) != 0 } }
+#define PL_STR(key, v) { PICOLOG_FIELD_STR, key, { .str = (v) } }
+
+/**
+ * @brief: prototype for picolog subscribers that take a picolog_record_t.
+ */
+typedef void (*picolog_record_function_t)(const picolog_record_t *record);
+
+/**
+ * @brief: prototype for picolog subscribers that take several records at once.
+ *
+ * records[0] to records[count-1] are in the order they were logged, and
+ * like a single record they are only valid until the subscriber returns.
+ * A sink that writes to a file, flash or the network can make one write of
+ * all of them rather than one per message.  Their text may be empty unless
+ * the subscriber was subscribed with picolog_subscribe_batch_text().
+ */
+typedef void (*picolog_batch_function_t)(const picolog_record_t *records,
+                                         size_t count);
+
+// any of the subscriber types above, for functions that take all of them
+typedef void (*picolog_any_function_t)(void);
+
+/**
+ * @brief: prototype for binary picolog subscribers.
+ *
+ * Instead of formatted text, a binary subscriber receives each message as a
+ * compact frame holding the level, the timestamp, the address of the format
+ * string and the raw arguments.  Frames are COBS encoded and end with a zero
+ * byte, so they can be written to a link back to back; on the host,
+ * tools/picolog_decode.py turns them back into text using the firmware's ELF
+ * file.  Like msg, frame is only valid until the subscriber returns.
+ */
+typedef void (*picolog_binary_function_t)(picolog_level_t severity,
+                                          const uint8_t *frame, size_t length);
+
+// the counts kept under PICOLOG_STATS, as returned by picolog_get_stats().
+// All of them start from zero at picolog_init() and wrap at 2^32.
+typedef struct {
+  uint32_t logged[PICOLOG_LEVEL_COUNT];  // messages logged, by level
+  uint32_t filtered;          // messages that reached picolog but that nobody wanted
+  uint32_t bytes_formatted;   // characters of text formatted for subscribers
+  uint32_t truncated;         // messages cut short at PICOLOG_MAX_MESSAGE_LENGTH
+  uint32_t queue_high_water;  // most bytes the deferred queue has held
+  struct {
+    picolog_any_function_t fn;    // the subscriber in each slot, or NULL
+    uint32_t time;                // PICOLOG_STATS_CLOCK() ticks spent in fn
+  } subscribers[PICOLOG_MAX_SUBSCRIBERS];
+} picolog_stats_t;
+
+// lowest level any subscriber takes, kept up to date by picolog_subscribe()
+// and picolog_unsubscribe().  Read only.
+extern volatile picolog_level_t picolog_min_threshold;
+// true while the trigger window may be open (see PICOLOG_TRIGGERED()).  Read
+// only.
+extern volatile bool picolog_trigger_armed;
+
 void picolog_init(picolog_level_t threshold);
 picolog_err_t picolog_subscribe(picolog_function_t fn, picolog_level_t threshold);
+picolog_err_t picolog_subscribe_mask(picolog_function_t fn, picolog_levels_t levels);
 picolog_err_t picolog_unsubscribe(picolog_function_t fn);
+picolog_err_t picolog_subscribe_timed(picolog_timed_function_t fn,
+                                      picolog_level_t threshold);
+picolog_err_t picolog_subscribe_timed_mask(picolog_timed_function_t fn,
+                                           picolog_levels_t levels);
+picolog_err_t picolog_unsubscribe_timed(picolog_timed_function_t fn);
+picolog_err_t picolog_subscribe_record(picolog_record_function_t fn,
+                                       picolog_level_t threshold);
+picolog_err_t picolog_subscribe_record_mask(picolog_record_function_t fn,
+                                            picolog_levels_t levels);
+picolog_err_t picolog_unsubscribe_record(picolog_record_function_t fn);
+picolog_err_t picolog_subscribe_record_args(picolog_record_function_t fn,
+                                            picolog_level_t threshold);
+picolog_err_t picolog_subscribe_record_args_mask(picolog_record_function_t fn,
+                                                 picolog_levels_t levels);
+picolog_err_t picolog_subscribe_binary(picolog_binary_function_t fn,
+                                       picolog_level_t threshold);
+picolog_err_t picolog_subscribe_binary_mask(picolog_binary_function_t fn,
+                                            picolog_levels_t levels);
+picolog_err_t picolog_unsubscribe_binary(picolog_binary_function_t fn);
+picolog_err_t picolog_subscribe_batch(picolog_batch_function_t fn,
+                                      picolog_level_t threshold);
+picolog_err_t picolog_subscribe_batch_mask(picolog_batch_function_t fn,
+                                           picolog_levels_t levels);
+picolog_err_t picolog_unsubscribe_batch(picolog_batch_function_t fn);
+picolog_err_t picolog_subscribe_batch_text(picolog_batch_function_t fn,
+                                           picolog_level_t threshold);
+picolog_err_t picolog_subscribe_batch_text_mask(picolog_batch_function_t fn,
+                                                picolog_levels_t levels);
 const char *picolog_level_name(picolog_level_t level);
-void picolog_message(picolog_level_t severity, const char *fmt, ...);
+void picolog_message(picolog_level_t severity, const char *fmt, ...)
+#ifdef __GNUC__
+  __attribute__((format(printf, 2, 3)))
+#endif
+  ;
+void picolog_channel_message(const picolog_channel_t *channel,
+                             picolog_level_t severity, const char *fmt, ...)
+#ifdef __GNUC__
+  __attribute__((format(printf, 3, 4)))
+#endif
+  ;
+picolog_err_t picolog_subscriber_channel(picolog_any_function_t fn,
+                                         const picolog_channel_t *channel);
+picolog_err_t picolog_subscriber_queued(picolog_any_function_t fn, bool queued);
+picolog_err_t picolog_subscriber_levels(picolog_any_function_t fn,
+                                        picolog_levels_t levels);
+picolog_err_t picolog_subscriber_threshold(picolog_any_function_t fn,
+                                           picolog_level_t threshold);
+void picolog_register_channel(picolog_channel_t *channel);
+picolog_channel_t *picolog_find_channel(const char *name);
+picolog_channel_t *picolog_channels(void);
 void picolog_format(picolog_level_t severity, char *msg);
+size_t picolog_format_line(char *line, size_t length, picolog_level_t severity,
+                           const char *msg);
+size_t picolog_encode_frame(uint8_t *frame, const picolog_record_t *record);
+void picolog_kv(picolog_level_t severity, const char *event,
+                const picolog_field_t *fields, size_t count);
+bool picolog_next_field(const picolog_record_t *record, size_t *offset,
+                        picolog_field_t *field);
+void picolog_message_packed(const picolog_channel_t *channel,
+                            picolog_level_t severity, const char *fmt,
+                            const uint8_t *args, size_t args_length);
+int picolog_flush(void);
+int picolog_flush_queued(void);
+uint32_t picolog_queued_dropped(picolog_any_function_t fn);
+uint32_t picolog_overruns(void);
+uint32_t picolog_dropped(picolog_level_t level);
+uint32_t picolog_suppressed(void);
+uint32_t picolog_random(void);
+void picolog_trigger(uint32_t duration_us);
+bool picolog_trigger_active(void);
+void picolog_get_stats(picolog_stats_t *stats);
+int picolog_vsnprintf(char *buf, size_t size, const char *fmt, va_list ap);
+int picolog_snprintf(char *buf, size_t size, const char *fmt, ...)
+#ifdef __GNUC__
+  __attribute__((format(printf, 3, 4)))
+#endif
+  ;
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,303 @@
+/**
+ * \file picolog.hpp
+ *
+ * \brief type-checked C++ front end for picolog (C++17 or later)
+ *
+ * Include this instead of picolog.h in C++ code and the level macros --
+ * PICOLOG_INFO(...), PICOLOG_CH_DEBUG(ch, ...), PICOLOG_EVERY_N(...) and the
+ * rest -- go through variadic templates rather than picolog_message()'s
+ * varargs:
+ *
+ *     #include "picolog.hpp"
+ *
+ *     PICOLOG_INFO("adc=%d vref=%.3f", adc, vref);    // as before
+ *     PICOLOG_INFO("adc=%s", adc);    // error: does not match its arguments
+ *
+ * Each format string is checked against the types of its arguments when the
+ * call is compiled, so a wrong conversion, a missing or extra argument or an
+ * unsupported conversion such as %n is an error rather than garbage at run
+ * time.  The arguments are then packed straight into the layout the deferred
+ * queue and the binary frames use: which conversion each one needs is known
+ * from its type, so fmt isn't parsed at run time, and the space taken by all
+ * but the strings is worked out at compile time and checked against
+ * PICOLOG_MAX_ARGS_LENGTH.  The packed message goes to
+ * picolog_message_packed(), and from there on nothing differs from a C call.
+ *
+ * The format string must therefore be a string literal.  Each argument must
+ * match its conversion exactly in size, as far as printf would see it once
+ * promoted: char, short and bool are taken as int, float as double, a %s
+ * needs a char pointer and a %p any pointer.  PICOLOG(level, ...) and
+ * PICOLOG_KV(...) are unchanged.
+ */
+
+#ifndef PICOLOG_HPP_
+#define PICOLOG_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "picolog.h"
+
+#if __cplusplus < 201703L
+#error "picolog.hpp needs C++17 or later"
+#endif
+
+namespace picolog {
+namespace detail {
+
+// how an argument is stored in the packed form: the same classes as
+// arg_class_t in picolog.c
+enum class arg_class {
+  none,           // takes no argument (%%), or a type picolog can't log
+  unsupported,    // a conversion picolog doesn't handle, e.g. %n
+  int_,
+  long_,
+  llong,
+  double_,
+  ldouble,
+  pointer,
+  string,
+};
+
+template <typename... T>
+struct type_list {};
+
+// the types of a call's arguments, for decltype(), as they would be passed
+template <typename... T>
+type_list<std::decay_t<T>...> types_of(T &&...);
+
+constexpr arg_class integer_class(std::size_t size) {
+  return size > sizeof(long) ? arg_class::llong
+       : size > sizeof(int) ? arg_class::long_
+       : arg_class::int_;
+}
+
+// the class an argument of type T is packed as
+template <typename T>
+constexpr arg_class class_of() {
+  if constexpr (std::is_same_v<T, char *> || std::is_same_v<T, const char *>) {
+    return arg_class::string;
+  } else if constexpr (std::is_pointer_v<T> || std::is_null_pointer_v<T>) {
+    return arg_class::pointer;
+  } else if constexpr (std::is_enum_v<T>) {
+    return class_of<std::underlying_type_t<T>>();
+  } else if constexpr (std::is_integral_v<T>) {
+    return integer_class(sizeof(T) < sizeof(int) ? sizeof(int) : sizeof(T));
+  } else if constexpr (std::is_same_v<T, long double>) {
+    return arg_class::ldouble;
+  } else if constexpr (std::is_floating_point_v<T>) {
+    return arg_class::double_;
+  } else {
+    return arg_class::none;
+  }
+}
+
+// bytes an argument of type T takes when packed; a string takes at least
+// its terminator
+template <typename T>
+constexpr std::size_t packed_size() {
+  switch (class_of<T>()) {
+    case arg_class::int_: return sizeof(int);
+    case arg_class::long_: return sizeof(long);
+    case arg_class::llong: return sizeof(long long);
+    case arg_class::double_: return sizeof(double);
+    case arg_class::ldouble: return sizeof(long double);
+    case arg_class::pointer: return sizeof(void *);
+    case arg_class::string: return 1;
+    default: return 0;
+  }
+}
+
+constexpr bool is_one_of(char c, const char *set) {
+  for (; *set; set++) {
+    if (*set == c) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// one conversion specification, parsed as parse_conversion() in picolog.c
+// does it
+struct conversion {
+  const char *end;    // one past the conversion character
+  int stars;          // number of '*' width/precision arguments
+  arg_class arg;
+};
+
+constexpr conversion parse_conversion(const char *p) {
+  conversion conv{nullptr, 0, arg_class::none};
+  std::size_t size = sizeof(int);
+  int longs = 0;
+  bool is_long_double = false;
+
+  for (p++; *p && is_one_of(*p, "-+ #0"); p++) {
+  }
+  for (; (*p >= '0' && *p <= '9') || *p == '*' || *p == '.'; p++) {
+    conv.stars += *p == '*';
+  }
+  for (; *p && is_one_of(*p, "hljztL"); p++) {
+    switch (*p) {
+      case 'l': longs++; break;
+      case 'L': is_long_double = true; break;
+      case 'j': size = sizeof(std::intmax_t); break;
+      case 'z': size = sizeof(std::size_t); break;
+      case 't': size = sizeof(std::ptrdiff_t); break;
+    }
+  }
+  if (longs == 1) {
+    size = sizeof(long);
+  } else if (longs > 1) {
+    size = sizeof(long long);
+  }
+  conv.end = *p ? p + 1 : p;
+  if (is_one_of(*p, "diuoxX")) {
+    conv.arg = integer_class(size);
+  } else if (*p == 'c') {
+    conv.arg = arg_class::int_;
+  } else if (is_one_of(*p, "fFeEgGaA")) {
+    conv.arg = is_long_double ? arg_class::ldouble : arg_class::double_;
+  } else if (*p == 'p') {
+    conv.arg = arg_class::pointer;
+  } else if (*p == 's') {
+    conv.arg = arg_class::string;
+  } else if (*p != '%') {
+    conv.arg = arg_class::unsupported;
+  }
+  return conv;
+}
+
+// true if an argument of class given may be passed for a conversion that
+// takes wanted
+constexpr bool matches(arg_class wanted, arg_class given) {
+  return wanted == given ||
+         (wanted == arg_class::pointer && given == arg_class::string);
+}
+
+// true if fmt consumes exactly the arguments in types, each of a class its
+// conversion takes
+template <typename... T>
+constexpr bool check_format(const char *fmt, type_list<T...>) {
+  constexpr arg_class given[] = { class_of<T>()..., arg_class::none };
+  std::size_t n = 0;
+  for (; *fmt; fmt++) {
+    if (*fmt != '%') {
+      continue;
+    }
+    conversion conv = parse_conversion(fmt);
+    if (conv.arg == arg_class::unsupported) {
+      return false;
+    }
+    for (int i=0; i<conv.stars; i++) {
+      if (n == sizeof...(T) || given[n++] != arg_class::int_) {
+        return false;
+      }
+    }
+    if (conv.arg != arg_class::none) {
+      if (n == sizeof...(T) || !matches(conv.arg, given[n++])) {
+        return false;
+      }
+    }
+    fmt = conv.end - 1;
+  }
+  return n == sizeof...(T);
+}
+
+// the arguments of one message, packed as pack_args() in picolog.c would
+class packer {
+ public:
+  explicit packer(std::size_t reserved) : length_(0), reserved_(reserved) {}
+
+  template <typename T>
+  void put(T value) {
+    if constexpr (class_of<T>() == arg_class::string) {
+      put_string(value);
+    } else if constexpr (class_of<T>() == arg_class::pointer) {
+      put_value(static_cast<const void *>(value));
+    } else if constexpr (std::is_enum_v<T>) {
+      put(static_cast<std::underlying_type_t<T>>(value));
+    } else if constexpr (class_of<T>() == arg_class::int_) {
+      put_value(static_cast<std::conditional_t<std::is_signed_v<T>, int, unsigned>>(value));
+    } else if constexpr (class_of<T>() == arg_class::long_) {
+      put_value(static_cast<std::conditional_t<std::is_signed_v<T>, long, unsigned long>>(value));
+    } else if constexpr (class_of<T>() == arg_class::llong) {
+      put_value(static_cast<std::conditional_t<std::is_signed_v<T>, long long,
+                                               unsigned long long>>(value));
+    } else if constexpr (class_of<T>() == arg_class::double_) {
+      put_value(static_cast<double>(value));
+    } else {
+      put_value(value);
+    }
+  }
+
+  const std::uint8_t *args() const { return args_; }
+  std::size_t length() const { return length_; }
+
+ private:
+  // reserved_ always leaves room for the arguments still to come, so
+  // anything but a string fits
+  template <typename T>
+  void put_value(const T &value) {
+    std::memcpy(&args_[length_], &value, sizeof(value));
+    length_ += sizeof(value);
+    reserved_ -= sizeof(value);
+  }
+
+  // strings are copied, and truncated to the room the later arguments leave
+  void put_string(const char *value) {
+    std::size_t room = PICOLOG_MAX_ARGS_LENGTH - length_ - reserved_;
+    std::size_t n = std::strlen(value ? value : "(null)");
+    if (n > room) {
+      n = room;
+    }
+    std::memcpy(&args_[length_], value ? value : "(null)", n);
+    args_[length_ + n] = '\0';
+    length_ += n + 1;
+    reserved_ -= 1;
+  }
+
+  std::uint8_t args_[PICOLOG_MAX_ARGS_LENGTH];
+  std::size_t length_;
+  std::size_t reserved_;    // bytes needed by the arguments not yet packed
+};
+
+template <typename... T>
+inline void message(const picolog_channel_t *channel, picolog_level_t severity,
+                    const char *fmt, T... args) {
+  constexpr std::size_t fixed = (packed_size<T>() + ... + 0);
+  static_assert(fixed <= PICOLOG_MAX_ARGS_LENGTH,
+                "picolog: arguments don't fit in PICOLOG_MAX_ARGS_LENGTH");
+  packer packed(fixed);
+  (packed.put(args), ...);
+  picolog_message_packed(channel, severity, fmt, packed.args(), packed.length());
+}
+
+}  // namespace detail
+}  // namespace picolog
+
+#ifdef PICOLOG_ENABLED
+
+// check fmt against the arguments given with it and log the message
+#define PICOLOG_CPP_MESSAGE_(ch, level, fmt, ...) do { \
+  static_assert(::picolog::detail::check_format( \
+                    fmt, decltype(::picolog::detail::types_of(__VA_ARGS__)){}), \
+                "picolog: format string does not match its arguments"); \
+  ::picolog::detail::message(ch, level, fmt, ##__VA_ARGS__); \
+} while(0)
+
+#undef PICOLOG_CALL_
+#define PICOLOG_CALL_(level, fmt, ...) \
+  PICOLOG_CPP_MESSAGE_(nullptr, level, fmt, ##__VA_ARGS__)
+
+#undef PICOLOG_CH_MESSAGE_
+#define PICOLOG_CH_MESSAGE_(ch, level, fmt, ...) do { \
+  if ((level) >= PICOLOG_COMPILE_LEVEL && (level) >= (ch).threshold && \
+      (level) >= picolog_min_threshold) \
+    PICOLOG_CPP_MESSAGE_(&(ch), level, fmt, ##__VA_ARGS__); \
+} while(0)
+
+#endif
+
+#endif /* PICOLOG_HPP_ */
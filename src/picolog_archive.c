@@ -0,0 +1,249 @@
+/**
+ * \file picolog_archive.c
+ *
+ * \brief picolog subscriber that compresses messages into blocks for flash
+ *        or bulk upload
+ *
+ * See picolog_archive.h.
+ */
+
+#include "picolog_archive.h"
+
+#include <string.h>
+
+// =============================================================================
+// types and definitions
+
+// the longest message in a block: the level, up to 10 bytes of time since
+// the message before, the format string's address, the length of the
+// arguments and the arguments themselves
+#define MAX_ENTRY_LENGTH (1 + 10 + 4 + 1 + PICOLOG_MAX_ARGS_LENGTH)
+
+_Static_assert(PICOLOG_ARCHIVE_BLOCK_SIZE <= 65535,
+               "PICOLOG_ARCHIVE_BLOCK_SIZE must fit in 16 bits");
+_Static_assert(PICOLOG_ARCHIVE_BLOCK_SIZE >= MAX_ENTRY_LENGTH,
+               "PICOLOG_ARCHIVE_BLOCK_SIZE must hold at least one message");
+_Static_assert(PICOLOG_MAX_ARGS_LENGTH <= 255,
+               "PICOLOG_MAX_ARGS_LENGTH must fit in the entry's length byte");
+
+#define FLAG_COMPRESSED 0x01
+#define STRUCTURED 0x80    // in an entry's level byte, as in a binary frame
+
+// the LZ4 block format: a match is at least 4 bytes long, the last 5 bytes
+// of a block are always literals and the last match starts at least 12
+// bytes before the end
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define MAX_OFFSET 65535
+
+// the most bytes LZ4 can take for length bytes of input that won't compress
+#define COMPRESS_BOUND(length) ((length) + (length) / 255 + 16)
+
+// =============================================================================
+// local storage
+
+static picolog_archive_write_t s_write;
+static uint8_t s_block[PICOLOG_ARCHIVE_BLOCK_SIZE];    // messages so far
+static size_t s_length;        // bytes in s_block
+static uint16_t s_count;       // messages in s_block
+static uint32_t s_sequence;    // sequence number...
+static uint64_t s_base;        // ...and timestamp of the first of them
+static uint64_t s_last;        // timestamp of the last of them
+// the block as written: header and payload
+static uint8_t s_out[PICOLOG_ARCHIVE_HEADER_SIZE +
+                     COMPRESS_BOUND(PICOLOG_ARCHIVE_BLOCK_SIZE)];
+// the compressor's table of the last position each hash was seen at
+static uint16_t s_table[1 << PICOLOG_ARCHIVE_HASH_BITS];
+
+// =============================================================================
+// forward declarations
+
+static void add_entry(const picolog_record_t *record);
+static size_t put_varint(uint8_t *p, uint64_t value);
+static void put_u16(uint8_t *p, uint16_t value);
+static void put_u32(uint8_t *p, uint32_t value);
+static size_t compress(const uint8_t *in, size_t length, uint8_t *out);
+
+// =============================================================================
+// user-visible code
+
+// write finished blocks with write
+void picolog_archive_init(picolog_archive_write_t write) {
+  s_write = write;
+  s_length = 0;
+  s_count = 0;
+}
+
+// the batch subscriber: add each record to the block, writing the block out
+// first whenever it is too full for the next
+void picolog_archive_batch(const picolog_record_t *records, size_t count) {
+  size_t i;
+  if (s_write == NULL) {
+    return;
+  }
+  for (i=0; i<count; i++) {
+    if (s_length + MAX_ENTRY_LENGTH > PICOLOG_ARCHIVE_BLOCK_SIZE) {
+      picolog_archive_flush();
+    }
+    add_entry(&records[i]);
+  }
+}
+
+// compress and write the messages gathered so far, if there are any.  This
+// must not run while the drain may be delivering to picolog_archive_batch():
+// call it where picolog_flush() is called, once that has returned.
+void picolog_archive_flush(void) {
+  uint8_t *payload = &s_out[PICOLOG_ARCHIVE_HEADER_SIZE];
+  size_t length;
+  uint8_t flags = FLAG_COMPRESSED;
+
+  if (s_write == NULL || s_count == 0) {
+    return;
+  }
+  length = compress(s_block, s_length, payload);
+  if (length >= s_length) {
+    memcpy(payload, s_block, s_length);    // no smaller: store it as it is
+    length = s_length;
+    flags = 0;
+  }
+  memcpy(s_out, "PLGA", 4);
+  s_out[4] = flags;
+  s_out[5] = 0;
+  put_u16(&s_out[6], s_count);
+  put_u16(&s_out[8], (uint16_t)s_length);
+  put_u16(&s_out[10], (uint16_t)length);
+  put_u32(&s_out[12], s_sequence);
+  put_u32(&s_out[16], (uint32_t)s_base);
+  put_u32(&s_out[20], (uint32_t)(s_base >> 32));
+  s_write(s_out, PICOLOG_ARCHIVE_HEADER_SIZE + length);
+  s_length = 0;
+  s_count = 0;
+}
+
+// =============================================================================
+// private code
+
+// append record to s_block, which has room for it
+static void add_entry(const picolog_record_t *record) {
+  uint8_t *p = &s_block[s_length];
+  size_t args_length = record->args_length < PICOLOG_MAX_ARGS_LENGTH ?
+                       record->args_length : PICOLOG_MAX_ARGS_LENGTH;
+  if (s_count == 0) {
+    s_sequence = record->sequence;
+    s_base = s_last = record->timestamp;
+  }
+  *p++ = (uint8_t)((record->severity - PICOLOG_TRACE_LEVEL) |
+                   (record->structured ? STRUCTURED : 0));
+  // messages reach the drain in order, but a timestamp can still be a
+  // little behind the one before when two cores log at once
+  p += put_varint(p, record->timestamp > s_last ? record->timestamp - s_last : 0);
+  if (record->timestamp > s_last) {
+    s_last = record->timestamp;
+  }
+  put_u32(p, (uint32_t)(uintptr_t)record->fmt);
+  p += 4;
+  *p++ = (uint8_t)args_length;
+  memcpy(p, record->args, args_length);
+  p += args_length;
+  s_length = p - s_block;
+  s_count++;
+}
+
+// write value 7 bits at a time, low bits first, with the top bit of each
+// byte set if more follow.  Returns the number of bytes written.
+static size_t put_varint(uint8_t *p, uint64_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    p[n++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  p[n++] = (uint8_t)value;
+  return n;
+}
+
+static void put_u16(uint8_t *p, uint16_t value) {
+  p[0] = (uint8_t)value;
+  p[1] = (uint8_t)(value >> 8);
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+  put_u16(p, (uint16_t)value);
+  put_u16(p + 2, (uint16_t)(value >> 16));
+}
+
+static uint32_t read_u32(const uint8_t *p) {
+  return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static size_t hash(uint32_t value) {
+  return (value * 2654435761u) >> (32 - PICOLOG_ARCHIVE_HASH_BITS);
+}
+
+// write an LZ4 length beyond what fits in its token nibble
+static uint8_t *put_length(uint8_t *op, size_t length) {
+  while (length >= 255) {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = (uint8_t)length;
+  return op;
+}
+
+// write one LZ4 sequence: literals from `literals` and then, unless
+// match_length is 0, a match of match_length bytes offset bytes back
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *literals, size_t literal_length,
+                             size_t offset, size_t match_length) {
+  uint8_t *token = op++;
+  size_t match_code = match_length ? match_length - MIN_MATCH : 0;
+  *token = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4 |
+                     (match_code < 15 ? match_code : 15));
+  if (literal_length >= 15) {
+    op = put_length(op, literal_length - 15);
+  }
+  memcpy(op, literals, literal_length);
+  op += literal_length;
+  if (match_length) {
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    if (match_code >= 15) {
+      op = put_length(op, match_code - 15);
+    }
+  }
+  return op;
+}
+
+// compress length bytes at in into out as an LZ4 block, returning its
+// length: a greedy match finder with one earlier position per hash, which
+// is quick rather than thorough.  out must have room for
+// COMPRESS_BOUND(length) bytes.
+static size_t compress(const uint8_t *in, size_t length, uint8_t *out) {
+  uint8_t *op = out;
+  size_t anchor = 0;    // start of the literals not yet written
+  size_t ip = 0;
+
+  memset(s_table, 0, sizeof(s_table));
+  if (length > MATCH_LIMIT) {
+    size_t limit = length - MATCH_LIMIT;
+    while (ip < limit) {
+      uint32_t value = read_u32(&in[ip]);
+      size_t h = hash(value);
+      size_t ref = s_table[h];
+      s_table[h] = (uint16_t)ip;
+      if (ref < ip && ip - ref <= MAX_OFFSET && read_u32(&in[ref]) == value) {
+        size_t match_length = MIN_MATCH;
+        while (ip + match_length < length - LAST_LITERALS &&
+               in[ref + match_length] == in[ip + match_length]) {
+          match_length++;
+        }
+        op = put_sequence(op, &in[anchor], ip - anchor, ip - ref, match_length);
+        ip += match_length;
+        anchor = ip;
+      } else {
+        ip++;
+      }
+    }
+  }
+  op = put_sequence(op, &in[anchor], length - anchor, 0, 0);
+  return op - out;
+}
@@ -0,0 +1,82 @@
+/**
+ * \file picolog_archive.h
+ *
+ * \brief picolog subscriber that compresses messages into blocks for flash
+ *        or bulk upload
+ *
+ * A batch subscriber that packs messages much more tightly than binary
+ * frames, for keeping days of history in a flash region or sending it over
+ * a metered link:
+ *
+ *     static void write_block(const uint8_t *block, size_t length) {
+ *         // program it into flash, or queue it for upload
+ *     }
+ *
+ *     picolog_archive_init(write_block);
+ *     PICOLOG_SUBSCRIBE_BATCH(picolog_archive_batch, PICOLOG_INFO_LEVEL);
+ *
+ * Messages are first written one after another into a block of
+ * PICOLOG_ARCHIVE_BLOCK_SIZE bytes as the level, the time since the
+ * message before as a variable length number (usually a byte or three
+ * rather than eight), the address of the format string, the length of the
+ * arguments in a byte and the packed arguments themselves.  When the next
+ * message won't fit, the block is compressed in the LZ4 block format,
+ * which finds the format strings and arguments that messages repeat, and
+ * handed to the write function with a short header; a block that doesn't
+ * compress is written as it is.  picolog_archive_flush() writes out the
+ * messages so far without waiting for the block to fill; it must not run
+ * while the drain is delivering, so call it just after picolog_flush().
+ *
+ * RAM is fixed: the block, the buffer it is compressed into and a
+ * 2^PICOLOG_ARCHIVE_HASH_BITS entry table for the compressor.  Blocks are
+ * written from the drain, so the write function should not take long; a
+ * flash sink can copy the block aside and program it later.  On the host,
+ * tools/picolog_archive.py turns the blocks back into text.
+ */
+
+#ifndef PICOLOG_ARCHIVE_H_
+#define PICOLOG_ARCHIVE_H_
+
+#include "picolog.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// bytes of messages gathered before a block is compressed and written, at
+// most 65535.  Larger blocks compress better but take longer to fill.
+#ifndef PICOLOG_ARCHIVE_BLOCK_SIZE
+#define PICOLOG_ARCHIVE_BLOCK_SIZE 2048
+#endif
+// size of the compressor's table of earlier positions, as a power of two.
+// Each entry takes two bytes.
+#ifndef PICOLOG_ARCHIVE_HASH_BITS
+#define PICOLOG_ARCHIVE_HASH_BITS 10
+#endif
+
+// bytes of the header at the start of each block written:
+//   "PLGA", flags (1 if compressed), 0, the number of messages, the length
+//   of the messages uncompressed and the length of the payload that follows
+//   as 16 bit numbers, then the sequence number of the first message (32
+//   bits) and its timestamp (64 bits), all little endian
+#define PICOLOG_ARCHIVE_HEADER_SIZE 24
+// the longest block written: a header and a payload that didn't compress
+#define PICOLOG_ARCHIVE_MAX_BLOCK_LENGTH \
+  (PICOLOG_ARCHIVE_HEADER_SIZE + PICOLOG_ARCHIVE_BLOCK_SIZE)
+
+/**
+ * @brief: prototype for the function blocks are written with.
+ *
+ * block is only valid until the function returns.
+ */
+typedef void (*picolog_archive_write_t)(const uint8_t *block, size_t length);
+
+void picolog_archive_init(picolog_archive_write_t write);
+void picolog_archive_batch(const picolog_record_t *records, size_t count);
+void picolog_archive_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOLOG_ARCHIVE_H_ */
@@ -0,0 +1,221 @@
+/**
+ * \file picolog_control.c
+ *
+ * \brief console commands to change picolog's levels on a running device
+ *
+ * See picolog_control.h.
+ */
+
+#include "picolog_control.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdio.h"
+#include "pico/time.h"
+
+// =============================================================================
+// types and definitions
+
+#define MAX_WORDS 4
+#define OFF_LEVEL ((picolog_level_t)(PICOLOG_ALWAYS_LEVEL + 1))
+
+// a channel whose threshold goes back to restore at time until
+typedef struct {
+  picolog_channel_t *channel;    // NULL if the slot is free
+  picolog_level_t restore;
+  uint64_t until;                // in time_us_64() terms
+} boost_t;
+
+// =============================================================================
+// local storage
+
+static char s_line[PICOLOG_CONTROL_LINE_LENGTH];    // the line being typed
+static size_t s_length;
+static bool s_overflow;    // the line is too long and will be ignored
+static boost_t s_boosts[PICOLOG_CONTROL_BOOSTS];
+
+// =============================================================================
+// forward declarations
+
+static bool parse_level(const char *word, picolog_level_t *level);
+static const char *level_name(picolog_level_t level);
+static bool set_channel(picolog_channel_t *channel, picolog_level_t level,
+                        uint32_t seconds);
+static boost_t *find_boost(const picolog_channel_t *channel);
+
+// =============================================================================
+// user-visible code
+
+// read whatever has arrived on stdin, without waiting, and end any timed
+// changes that have run out.  Call it regularly, e.g. from the main loop.
+void picolog_control_poll(void) {
+  uint64_t now = time_us_64();
+  int c;
+  int i;
+  while ((c = getchar_timeout_us(0)) >= 0) {
+    picolog_control_input((char)c);
+  }
+  for (i=0; i<PICOLOG_CONTROL_BOOSTS; i++) {
+    boost_t *boost = &s_boosts[i];
+    if (boost->channel != NULL && now >= boost->until) {
+      PICOLOG_CHANNEL_SET(*boost->channel, boost->restore);
+      PICOLOG_ALWAYS("%s: back to %s", boost->channel->name, level_name(boost->restore));
+      boost->channel = NULL;
+    }
+  }
+}
+
+// add one character of input to the line being typed, running the line as
+// a command at its end
+void picolog_control_input(char c) {
+  if (c == '\r' || c == '\n') {
+    s_line[s_length] = '\0';
+    if (!s_overflow && s_length > 0) {
+      picolog_control_command(s_line);
+    }
+    s_length = 0;
+    s_overflow = false;
+  } else if (c == '\b' || c == 0x7F) {
+    if (s_length > 0) {
+      s_length--;
+    }
+  } else if (s_length + 1 < PICOLOG_CONTROL_LINE_LENGTH) {
+    s_line[s_length++] = c;
+  } else {
+    s_overflow = true;
+  }
+}
+
+// run one command (see picolog_control.h), returning false if it is not
+// one that could be carried out
+bool picolog_control_command(const char *line) {
+  char copy[PICOLOG_CONTROL_LINE_LENGTH];
+  char *words[MAX_WORDS];
+  int count = 0;
+  char *p;
+
+  strncpy(copy, line, sizeof(copy) - 1);
+  copy[sizeof(copy) - 1] = '\0';
+  for (p=strtok(copy, " \t"); p!=NULL && count<MAX_WORDS; p=strtok(NULL, " \t")) {
+    words[count++] = p;
+  }
+  if (count == 0) {
+    return false;
+  }
+  if (p != NULL) {
+    count = MAX_WORDS + 1;    // more words than any command takes
+  }
+
+  if (strcmp(words[0], "list") == 0 && count == 1) {
+    picolog_channel_t *channel;
+    for (channel=picolog_channels(); channel!=NULL; channel=channel->next) {
+      PICOLOG_ALWAYS("%s: %s", channel->name, level_name(channel->threshold));
+    }
+    return true;
+  }
+
+  if (strcmp(words[0], "set") == 0 && (count == 3 || count == 4)) {
+    picolog_level_t level;
+    uint32_t seconds = 0;
+    bool ok = true;
+    if (!parse_level(words[2], &level)) {
+      PICOLOG_WARNING("no level called %s", words[2]);
+      return false;
+    }
+    if (count == 4) {
+      char *end;
+      seconds = strtoul(words[3], &end, 10);
+      if (*end != '\0' || seconds == 0) {
+        PICOLOG_WARNING("%s is not a number of seconds", words[3]);
+        return false;
+      }
+    }
+    if (strcmp(words[1], "*") == 0) {
+      picolog_channel_t *channel;
+      for (channel=picolog_channels(); channel!=NULL; channel=channel->next) {
+        ok = set_channel(channel, level, seconds) && ok;
+      }
+      return ok;
+    } else {
+      picolog_channel_t *channel = picolog_find_channel(words[1]);
+      if (channel == NULL) {
+        PICOLOG_WARNING("no channel called %s", words[1]);
+        return false;
+      }
+      return set_channel(channel, level, seconds);
+    }
+  }
+
+  PICOLOG_WARNING("unknown command: %s (use set <channel>|* <level> [seconds], or list)",
+                  line);
+  return false;
+}
+
+// =============================================================================
+// private code
+
+// the level word names, in either case
+static bool parse_level(const char *word, picolog_level_t *level) {
+  picolog_level_t l;
+  for (l=PICOLOG_TRACE_LEVEL; l<=OFF_LEVEL; l++) {
+    const char *name = level_name(l);
+    size_t i;
+    for (i=0; name[i] && toupper((unsigned char)word[i]) == name[i]; i++) {
+    }
+    if (name[i] == '\0' && word[i] == '\0') {
+      *level = l;
+      return true;
+    }
+  }
+  return false;
+}
+
+static const char *level_name(picolog_level_t level) {
+  return level > PICOLOG_ALWAYS_LEVEL ? "OFF" : picolog_level_name(level);
+}
+
+// set channel's threshold to level, for seconds if that isn't 0 and for
+// good otherwise.  If no subscriber takes level, say so: the messages it
+// lets through are still lost.
+static bool set_channel(picolog_channel_t *channel, picolog_level_t level,
+                        uint32_t seconds) {
+  boost_t *boost = find_boost(channel);
+  if (level < picolog_min_threshold) {
+    PICOLOG_WARNING("%s: no subscriber takes %s", channel->name, level_name(level));
+  }
+  if (seconds == 0) {
+    if (boost != NULL) {
+      boost->channel = NULL;    // a level set for good ends any timed one
+    }
+    PICOLOG_CHANNEL_SET(*channel, level);
+    PICOLOG_ALWAYS("%s: %s", channel->name, level_name(level));
+    return true;
+  }
+  if (boost == NULL) {
+    boost = find_boost(NULL);
+    if (boost == NULL) {
+      PICOLOG_WARNING("%s: too many timed changes", channel->name);
+      return false;
+    }
+    boost->restore = channel->threshold;    // a repeat keeps the first one's
+  }
+  boost->until = time_us_64() + (uint64_t)seconds * 1000000;
+  boost->channel = channel;
+  PICOLOG_CHANNEL_SET(*channel, level);
+  PICOLOG_ALWAYS("%s: %s for %lu s", channel->name, level_name(level),
+                 (unsigned long)seconds);
+  return true;
+}
+
+// the slot of the timed change to channel, or a free slot if channel is NULL
+static boost_t *find_boost(const picolog_channel_t *channel) {
+  int i;
+  for (i=0; i<PICOLOG_CONTROL_BOOSTS; i++) {
+    if (s_boosts[i].channel == channel) {
+      return &s_boosts[i];
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,64 @@
+/**
+ * \file picolog_control.h
+ *
+ * \brief console commands to change picolog's levels on a running device
+ *
+ * A small line parser for the console (UART or USB stdio) or any other
+ * link, so that logging on a live unit can be turned up for a while and
+ * then back down without rebuilding it:
+ *
+ *     PICOLOG_CHANNEL_DEFINE(radio_log, "radio", PICOLOG_INFO_LEVEL);
+ *
+ *     PICOLOG_CHANNEL_REGISTER(radio_log);
+ *     for (;;) {
+ *         picolog_control_poll();    // reads stdin without waiting
+ *         ...
+ *     }
+ *
+ * and then on the console:
+ *
+ *     set radio debug 10    radio logs DEBUG and up for 10 s, then INFO again
+ *     set radio warning     radio logs WARNING and up from now on
+ *     set * trace 5         every registered channel logs everything for 5 s
+ *     list                  log the level of every registered channel
+ *
+ * Levels are named as picolog_level_name() names them, in either case, or
+ * "off".  Only registered channels can be set, and only their thresholds:
+ * a message must also pass a subscriber's threshold, which the console
+ * can't change, so messages below every subscriber's threshold are still
+ * lost until the application lowers one with picolog_subscriber_threshold().
+ * Setting a channel to such a level is warned about.  The outcome of each
+ * command is logged at ALWAYS, so it goes wherever the log does; commands
+ * that arrive some other way, e.g. over the network, can be run with
+ * picolog_control_command(); timed changes run out in picolog_control_poll(),
+ * so it must be called even then.  Nothing in the logging path changes: a
+ * channel's threshold is still one compare in the level macros.
+ */
+
+#ifndef PICOLOG_CONTROL_H_
+#define PICOLOG_CONTROL_H_
+
+#include "picolog.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// longest command line accepted; longer lines are ignored
+#ifndef PICOLOG_CONTROL_LINE_LENGTH
+#define PICOLOG_CONTROL_LINE_LENGTH 48
+#endif
+// number of channels that may have a change timed to run out at once
+#ifndef PICOLOG_CONTROL_BOOSTS
+#define PICOLOG_CONTROL_BOOSTS 4
+#endif
+
+void picolog_control_poll(void);
+void picolog_control_input(char c);
+bool picolog_control_command(const char *line);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOLOG_CONTROL_H_ */
@@ -0,0 +1,164 @@
+/**
+ * \file picolog_crash.c
+ *
+ * \brief picolog subscriber that keeps the last messages in RAM across resets
+ *
+ * See picolog_crash.h.
+ */
+
+#include "picolog_crash.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "pico/platform.h"
+#include "hardware/sync.h"
+
+// =============================================================================
+// types and definitions
+
+// one message, as it was logged.  `stamp` is written last, once the rest
+// is complete, so an entry cut short by a reset isn't dumped.
+typedef struct {
+  uint32_t stamp;         // the entry's position in the ring + 1, or 0
+  uint32_t sequence;
+  uint32_t timestamp;     // low 32 bits, as in binary frames
+  const char *fmt;
+  uint16_t boot;          // header.boot when it was logged
+  uint8_t severity;       // with the top bit set for a structured message
+  uint8_t args_length;
+  uint8_t args[PICOLOG_MAX_ARGS_LENGTH];
+} entry_t;
+
+_Static_assert(PICOLOG_MAX_ARGS_LENGTH <= 255,
+               "PICOLOG_MAX_ARGS_LENGTH must fit in an entry's args_length");
+
+// `crc` covers every field before it, which only change in
+// picolog_crash_init(), so appending needn't update it.  `head` counts every
+// entry claimed since the ring was started.
+typedef struct {
+  uint32_t magic;
+  uint32_t entry_size;    // so that a change of configuration is noticed
+  uint32_t entries;
+  uint32_t boot;          // goes up by one at each picolog_crash_init()
+  uint32_t crc;
+  volatile uint32_t head;
+  entry_t ring[PICOLOG_CRASH_LOG_ENTRIES];
+} crash_log_t;
+
+#define CRASH_LOG_MAGIC 0x43474c50    // "PLGC"
+
+// =============================================================================
+// local storage
+
+static crash_log_t __uninitialized_ram(s_log);
+static bool s_started;    // picolog_crash_init() has been called
+static spin_lock_t *s_lock;    // guards the claiming of entries
+
+// =============================================================================
+// forward declarations
+
+static uint32_t header_crc(const crash_log_t *log);
+
+// =============================================================================
+// user-visible code
+
+// check the ring left by the previous boot and start this boot's entries.
+// Call this before subscribing picolog_crash_log.
+void picolog_crash_init(void) {
+  if (s_log.magic != CRASH_LOG_MAGIC || s_log.entry_size != sizeof(entry_t) ||
+      s_log.entries != PICOLOG_CRASH_LOG_ENTRIES || s_log.crc != header_crc(&s_log)) {
+    // power-on, or a different configuration: start afresh
+    memset(&s_log, 0, sizeof(s_log));
+    s_log.magic = CRASH_LOG_MAGIC;
+    s_log.entry_size = sizeof(entry_t);
+    s_log.entries = PICOLOG_CRASH_LOG_ENTRIES;
+  }
+  s_log.boot++;
+  s_log.crc = header_crc(&s_log);
+  if (s_lock == NULL) {
+    s_lock = spin_lock_instance(spin_lock_claim_unused(true));
+  }
+  s_started = true;
+}
+
+// the record subscriber: claim the next entry and copy record into it.  In
+// immediate mode it runs wherever the message was logged, so an interrupt
+// handler or the other core may append at the same time: each claims an
+// entry of its own under s_lock, and fills it outside.
+void picolog_crash_log(const picolog_record_t *record) {
+  uint32_t head, save;
+  entry_t *entry;
+  if (!s_started) {
+    return;
+  }
+  save = spin_lock_blocking(s_lock);
+  head = s_log.head;
+  entry = &s_log.ring[head % PICOLOG_CRASH_LOG_ENTRIES];
+  entry->stamp = 0;
+  s_log.head = head + 1;
+  spin_unlock(s_lock, save);
+  entry->sequence = record->sequence;
+  entry->timestamp = (uint32_t)record->timestamp;
+  entry->fmt = record->fmt;
+  entry->boot = (uint16_t)s_log.boot;
+  entry->severity = (uint8_t)record->severity | (record->structured ? 0x80 : 0);
+  entry->args_length = record->args_length < PICOLOG_MAX_ARGS_LENGTH ?
+                       (uint8_t)record->args_length : PICOLOG_MAX_ARGS_LENGTH;
+  memcpy(entry->args, record->args, entry->args_length);
+  __atomic_store_n(&entry->stamp, head + 1, __ATOMIC_RELEASE);
+}
+
+// pass each message kept from the previous boot to fn, oldest first, as a
+// binary frame.  Returns the number of messages.
+int picolog_dump_previous_boot(picolog_binary_function_t fn) {
+  uint8_t frame[PICOLOG_MAX_FRAME_LENGTH];
+  uint16_t previous = (uint16_t)(s_log.boot - 1);
+  uint32_t head = s_log.head;
+  uint32_t i = head > PICOLOG_CRASH_LOG_ENTRIES ? head - PICOLOG_CRASH_LOG_ENTRIES : 0;
+  int count = 0;
+
+  if (!s_started || s_log.boot < 2) {
+    return 0;    // not initialised, or there was no previous boot
+  }
+  for (; i<head; i++) {
+    const entry_t *entry = &s_log.ring[i % PICOLOG_CRASH_LOG_ENTRIES];
+    picolog_record_t record;
+    if (entry->stamp != i + 1 || entry->boot != previous) {
+      continue;    // not complete, overwritten, or from another boot
+    }
+    memset(&record, 0, sizeof(record));
+    record.severity = (picolog_level_t)(entry->severity & 0x7F);
+    record.structured = (entry->severity & 0x80) != 0;
+    record.timestamp = entry->timestamp;
+    record.sequence = entry->sequence;
+    record.fmt = entry->fmt;
+    record.args = entry->args;
+    record.args_length = entry->args_length;
+    fn(record.severity, frame, picolog_encode_frame(frame, &record));
+    count++;
+  }
+  return count;
+}
+
+// =============================================================================
+// private code
+
+// CRC-32 (as used by zlib) of the header fields before `crc`, four bits at a
+// time to keep the table small
+static uint32_t header_crc(const crash_log_t *log) {
+  static const uint32_t table[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+    0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+  };
+  const uint8_t *p = (const uint8_t *)log;
+  size_t length = offsetof(crash_log_t, crc);
+  uint32_t crc = 0xFFFFFFFF;
+  while (length--) {
+    crc ^= *p++;
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+  }
+  return ~crc;
+}
@@ -0,0 +1,58 @@
+/**
+ * \file picolog_crash.h
+ *
+ * \brief picolog subscriber that keeps the last messages in RAM across resets
+ *
+ * A record subscriber that copies each message -- unformatted: the level,
+ * fmt pointer, timestamp and packed arguments -- into a ring of
+ * PICOLOG_CRASH_LOG_ENTRIES fixed size entries in uninitialised RAM, which
+ * the boot code leaves alone.  After a hard fault, watchdog reset or
+ * picking up a debugger, the messages logged just before are still there,
+ * and picolog_dump_previous_boot() hands them out as binary frames:
+ *
+ *     picolog_crash_init();
+ *     picolog_dump_previous_boot(picolog_uart_dma_binary);
+ *     PICOLOG_SUBSCRIBE_RECORD_ARGS(picolog_crash_log, PICOLOG_TRACE_LEVEL);
+ *
+ * Appending an entry is a memcpy, and subscribed for the arguments alone it
+ * never has a message formatted for it, so it can stay subscribed at TRACE.
+ * It is safe to log from interrupt handlers and both cores at once: each
+ * append claims an entry under a hardware spin lock, held just long enough
+ * to advance the head, and marks it complete once it is filled, so an
+ * entry cut short by a reset is left out of the dump rather than mixed up
+ * with another.  A fault handler that logs while the code it interrupted
+ * holds that lock, for the few instructions it does, would wait forever.  The ring's header has a magic number and a CRC, so
+ * after a power-on, when RAM holds garbage, it is started afresh.  Each boot
+ * keeps logging into the same ring, so the previous boot's entries are
+ * overwritten as the new boot logs: dump them first.  The fmt pointers are
+ * only meaningful with the ELF file of the firmware that logged them, which
+ * is what tools/picolog_decode.py expects anyway.
+ *
+ * With PICOLOG_DEFERRED, messages reach the ring when they are drained, so
+ * any still queued at a crash are lost; PICOLOG_DRAIN_CORE1 keeps that gap
+ * short.
+ */
+
+#ifndef PICOLOG_CRASH_H_
+#define PICOLOG_CRASH_H_
+
+#include "picolog.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// number of messages kept.  Each takes PICOLOG_MAX_ARGS_LENGTH + 20 bytes.
+#ifndef PICOLOG_CRASH_LOG_ENTRIES
+#define PICOLOG_CRASH_LOG_ENTRIES 32
+#endif
+
+void picolog_crash_init(void);
+void picolog_crash_log(const picolog_record_t *record);
+int picolog_dump_previous_boot(picolog_binary_function_t fn);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOLOG_CRASH_H_ */
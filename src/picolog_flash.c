@@ -0,0 +1,258 @@
+/**
+ * \file picolog_flash.c
+ *
+ * \brief picolog subscriber that keeps a persistent log in QSPI flash
+ *
+ * See picolog_flash.h.
+ */
+
+#include "picolog_flash.h"
+
+#include <string.h>
+
+#include "hardware/flash.h"
+#include "hardware/regs/addressmap.h"
+#include "pico/flash.h"
+
+// =============================================================================
+// types and definitions
+
+// every sector in use starts with this header.  `sequence` goes up by one
+// each time writing moves on to a new sector, so the newest sector is the one
+// with the highest sequence.
+typedef struct {
+  uint32_t magic;
+  uint32_t sequence;
+} sector_header_t;
+
+#define SECTOR_MAGIC 0x31474c50    // "PLG1"
+#define PAGES_PER_SECTOR (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+
+// how long flash_safe_execute() may wait for the other core to stand still
+#define SAFE_EXECUTE_TIMEOUT_MS 10
+
+// set in a frame's level byte for a structured message
+#define STRUCTURED 0x80
+
+// =============================================================================
+// local storage
+
+static uint32_t s_offset;          // start of the region, from start of flash
+static uint32_t s_sectors;         // number of sectors in the region
+static uint32_t s_sector;          // sector being written
+static uint32_t s_page;            // page within it to be programmed next
+static uint32_t s_sequence;        // sequence of s_sector
+static uint8_t s_staging[FLASH_PAGE_SIZE];
+static size_t s_fill;              // bytes used in s_staging
+static uint32_t s_failures;        // flash operations that failed
+
+// =============================================================================
+// forward declarations
+
+static const uint8_t *sector_data(uint32_t sector);
+static bool page_is_erased(const uint8_t *page);
+static void start_sector(uint32_t sector, uint32_t sequence);
+static void program_page(void);
+static void erase_sector(uint32_t sector);
+static void do_program(void *param);
+static void do_erase(void *param);
+
+// =============================================================================
+// user-visible code
+
+// use size bytes of flash starting offset bytes from its start, which must
+// both be whole sectors, and find where writing left off.
+picolog_err_t picolog_flash_init(uint32_t offset, uint32_t size) {
+  const sector_header_t *header;
+  uint32_t sector;
+  bool found = false;
+
+  if (offset % FLASH_SECTOR_SIZE || size % FLASH_SECTOR_SIZE ||
+      size < 2 * FLASH_SECTOR_SIZE) {
+    return PICOLOG_ERR_INVALID_ARGUMENT;
+  }
+  s_offset = offset;
+  s_sectors = size / FLASH_SECTOR_SIZE;
+  s_fill = 0;
+
+  for (sector=0; sector<s_sectors; sector++) {
+    header = (const sector_header_t *)sector_data(sector);
+    if (header->magic == SECTOR_MAGIC &&
+        (!found || (int32_t)(header->sequence - s_sequence) > 0)) {
+      s_sector = sector;
+      s_sequence = header->sequence;
+      found = true;
+    }
+  }
+  if (!found) {
+    // an empty region: start with a delimiter, as picolog_flash_dump()
+    // ignores everything before the first one.
+    start_sector(0, 1);
+    s_staging[s_fill++] = 0;
+    return PICOLOG_ERR_NONE;
+  }
+  // pages are programmed in order, so the first erased page is the next one
+  for (s_page=1; s_page<PAGES_PER_SECTOR; s_page++) {
+    if (page_is_erased(sector_data(s_sector) + s_page * FLASH_PAGE_SIZE)) {
+      break;
+    }
+  }
+  if (s_page == PAGES_PER_SECTOR) {
+    start_sector((s_sector + 1) % s_sectors, s_sequence + 1);
+  }
+  // terminate any frame cut short by the reset, which may run on into the
+  // next sector since picolog_flash_dump() reads across them
+  s_staging[s_fill++] = 0;
+  return PICOLOG_ERR_NONE;
+}
+
+// the binary subscriber: append the frame, programming pages as they fill
+void picolog_flash(picolog_level_t severity, const uint8_t *frame, size_t length) {
+  size_t n;
+  if (s_sectors == 0) {
+    return;
+  }
+  while (length > 0) {
+    n = FLASH_PAGE_SIZE - s_fill;
+    if (n > length) {
+      n = length;
+    }
+    memcpy(&s_staging[s_fill], frame, n);
+    s_fill += n;
+    frame += n;
+    length -= n;
+    if (s_fill == FLASH_PAGE_SIZE) {
+      program_page();
+    }
+  }
+}
+
+// program the partly filled RAM page now, e.g. before a deliberate reset.
+// The rest of the page is padded with (empty) frame delimiters.
+void picolog_flash_sync(void) {
+  if (s_sectors == 0 || s_fill == 0) {
+    return;
+  }
+  memset(&s_staging[s_fill], 0, FLASH_PAGE_SIZE - s_fill);
+  s_fill = FLASH_PAGE_SIZE;
+  program_page();
+}
+
+// pass every frame stored in flash to fn, oldest first.  Frames still in the
+// RAM page are not included.
+void picolog_flash_dump(picolog_binary_function_t fn) {
+  uint8_t frame[PICOLOG_MAX_FRAME_LENGTH];
+  size_t length = 0;
+  bool synced = false;    // false until the first delimiter
+  uint32_t i, page, sector;
+  const uint8_t *data;
+
+  if (s_sectors == 0) {
+    return;
+  }
+  for (i=1; i<=s_sectors; i++) {
+    sector = (s_sector + i) % s_sectors;
+    data = sector_data(sector);
+    if (((const sector_header_t *)data)->magic != SECTOR_MAGIC) {
+      continue;    // erased ahead, or never used
+    }
+    for (page=0; page<PAGES_PER_SECTOR; page++) {
+      const uint8_t *p = data + page * FLASH_PAGE_SIZE;
+      const uint8_t *end = p + FLASH_PAGE_SIZE;
+      if (page > 0 && page_is_erased(p)) {
+        break;
+      }
+      if (page == 0) {
+        p += sizeof(sector_header_t);
+      }
+      for (; p<end; p++) {
+        if (*p != 0) {
+          if (length < sizeof(frame) - 1) {
+            frame[length++] = *p;
+          }
+          continue;
+        }
+        if (synced && length > 0) {
+          // the first COBS byte is 1 when the level byte itself is zero
+          uint8_t level = frame[0] == 1 ? 0 : frame[1] & ~STRUCTURED;
+          frame[length++] = 0;
+          fn((picolog_level_t)(PICOLOG_TRACE_LEVEL + level), frame, length);
+        }
+        synced = true;
+        length = 0;
+      }
+    }
+  }
+}
+
+// number of page programs and sector erases that failed, for instance
+// because the other core could not be parked in time.  Each failure loses
+// up to a sector's worth of frames.
+uint32_t picolog_flash_failures(void) {
+  return s_failures;
+}
+
+// =============================================================================
+// private code
+
+// the contents of a sector, as read through XIP
+static const uint8_t *sector_data(uint32_t sector) {
+  return (const uint8_t *)(uintptr_t)(XIP_BASE + s_offset + sector * FLASH_SECTOR_SIZE);
+}
+
+static bool page_is_erased(const uint8_t *page) {
+  size_t i;
+  for (i=0; i<FLASH_PAGE_SIZE; i++) {
+    if (page[i] != 0xFF) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// begin writing sector, which must be erased, and erase the one after it so
+// that it is ready in turn.
+static void start_sector(uint32_t sector, uint32_t sequence) {
+  sector_header_t header = { SECTOR_MAGIC, sequence };
+  const uint8_t *data = sector_data(sector);
+  uint32_t next = (sector + 1) % s_sectors;
+
+  if (!page_is_erased(data)) {
+    erase_sector(sector);
+  }
+  s_sector = sector;
+  s_sequence = sequence;
+  s_page = 0;
+  memcpy(s_staging, &header, sizeof(header));
+  s_fill = sizeof(header);
+  if (!page_is_erased(sector_data(next))) {
+    erase_sector(next);
+  }
+}
+
+static void program_page(void) {
+  uint32_t offset = s_offset + s_sector * FLASH_SECTOR_SIZE + s_page * FLASH_PAGE_SIZE;
+  if (flash_safe_execute(do_program, &offset, SAFE_EXECUTE_TIMEOUT_MS) != PICO_OK) {
+    s_failures++;
+  }
+  s_fill = 0;
+  if (++s_page == PAGES_PER_SECTOR) {
+    start_sector((s_sector + 1) % s_sectors, s_sequence + 1);
+  }
+}
+
+static void erase_sector(uint32_t sector) {
+  uint32_t offset = s_offset + sector * FLASH_SECTOR_SIZE;
+  if (flash_safe_execute(do_erase, &offset, SAFE_EXECUTE_TIMEOUT_MS) != PICO_OK) {
+    s_failures++;
+  }
+}
+
+// run by flash_safe_execute() with XIP disabled and the other core parked
+static void do_program(void *param) {
+  flash_range_program(*(uint32_t *)param, s_staging, FLASH_PAGE_SIZE);
+}
+
+static void do_erase(void *param) {
+  flash_range_erase(*(uint32_t *)param, FLASH_SECTOR_SIZE);
+}
@@ -0,0 +1,49 @@
+/**
+ * \file picolog_flash.h
+ *
+ * \brief picolog subscriber that keeps a persistent log in QSPI flash
+ *
+ * Binary frames (see picolog_binary_function_t) are appended to a reserved
+ * region of flash so that they survive brownouts and watchdog resets.  The
+ * region is used as a ring of sectors: frames are collected in a RAM page
+ * and programmed a whole page at a time, and the sector after the one being
+ * written is erased ahead of time, so the oldest sector is the one given up
+ * and every sector wears at the same rate.  Programming and erasing stall
+ * XIP (and so both cores) and are done through flash_safe_execute(), which
+ * is why writes are kept few and large.  flash_safe_execute() has to park
+ * the other core first, which it can only do once that core has called
+ * multicore_lockout_victim_init().  So with PICOLOG_DRAIN_CORE1, where the
+ * writes happen on core1, core0 must call it at startup, or every write
+ * fails, is counted by picolog_flash_failures() and saves nothing.
+ *
+ *     // the last 256 KiB of flash, which the firmware must not use
+ *     picolog_flash_init(PICO_FLASH_SIZE_BYTES - 256 * 1024, 256 * 1024);
+ *     picolog_flash_dump(picolog_uart_dma_binary);    // the previous boots
+ *     PICOLOG_SUBSCRIBE_BINARY(picolog_flash, PICOLOG_WARNING_LEVEL);
+ *
+ * picolog_flash_init() finds where writing left off by reading one small
+ * header per sector and the pages of the newest sector, never the whole
+ * region.  Frames still in the RAM page are lost on a reset unless
+ * picolog_flash_sync() has been called.
+ */
+
+#ifndef PICOLOG_FLASH_H_
+#define PICOLOG_FLASH_H_
+
+#include "picolog.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+picolog_err_t picolog_flash_init(uint32_t offset, uint32_t size);
+void picolog_flash(picolog_level_t severity, const uint8_t *frame, size_t length);
+void picolog_flash_sync(void);
+void picolog_flash_dump(picolog_binary_function_t fn);
+uint32_t picolog_flash_failures(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOLOG_FLASH_H_ */
@@ -0,0 +1,671 @@
+/**
+ * \file picolog_printf.c
+ *
+ * \brief picolog's own small replacement for vsnprintf
+ *
+ * newlib's printf family is several KB of flash and, for the handful of
+ * conversions that log messages actually use, slow.  This formatter covers
+ * %d %i %u %o %x %X %c %s %p %f %e %g and %% with the usual flags, width,
+ * precision and length modifiers.  Integers are converted two digits at a
+ * time from a table (64 bit values are split into 32 bit chunks first so
+ * that only one 64 bit division is needed per 8 digits) and floating point
+ * values are converted exactly, nine digits at a time in 32 bit words,
+ * with no heap and no locale.  Floating point output matches the C
+ * library's to 24 significant digits at any precision; but digits after
+ * the 24th are printed as zeros, halfway cases round away from zero rather
+ * than to even and %a is printed as %e.
+ *
+ * picolog uses it in place of vsnprintf when built with
+ * -DPICOLOG_BUILTIN_PRINTF, but it can be called directly either way.
+ */
+
+#include "picolog.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// =============================================================================
+// types and definitions
+
+// the output buffer: characters past the end are counted but not stored
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t n;
+} output_t;
+
+// a parsed conversion specification
+typedef struct {
+  bool left;         // '-'
+  bool plus;         // '+'
+  bool space;        // ' '
+  bool alternate;    // '#'
+  bool zero;         // '0'
+  int width;
+  int precision;     // -1 if not given
+  char length;       // 'H' (hh), 'h', 'l', 'L' (ll), 'j', 'z', 't' or 0
+  char conversion;
+} spec_t;
+
+// longest digit string: a 64 bit octal number
+#define DIGITS_LENGTH 32
+// significant digits worked out for a floating point conversion; any more
+// that are asked for are printed as zeros
+#define MAX_SIGNIFICANT 24
+// 32 bit words in the longest part of a double: its fraction, which has up
+// to 1074 bits, or its integer part, which has up to 1024 and is built
+// three words past its lowest
+#define BIG_WORDS 35
+#define BILLION 1000000000u
+
+// the digits to_decimal() has collected so far, and the position of the
+// next one as a power of ten
+typedef struct {
+  char *digits;
+  int count;
+  int exponent;    // position of the first
+  int position;
+} decimal_t;
+
+static const char s_digit_pairs[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+// =============================================================================
+// forward declarations
+
+static void put(output_t *out, char c);
+static void put_padding(output_t *out, char c, int count);
+static const char *parse_spec(const char *fmt, spec_t *spec, va_list *ap);
+static void format_integer(output_t *out, const spec_t *spec, uint64_t value,
+                           bool negative);
+static void format_double(output_t *out, const spec_t *spec, double value);
+static void format_field(output_t *out, const spec_t *spec, const char *prefix,
+                         const char *digits, int length, int zeros);
+static int utoa_decimal(char *end, uint64_t value);
+static void add_digits(decimal_t *decimal, const char *text, int length);
+static void add_chunk(decimal_t *decimal, uint32_t chunk);
+
+// =============================================================================
+// user-visible code
+
+int picolog_vsnprintf(char *buf, size_t size, const char *fmt, va_list ap) {
+  output_t out = { buf, size, 0 };
+  spec_t spec;
+  va_list args;
+
+  va_copy(args, ap);
+  while (*fmt) {
+    if (*fmt != '%') {
+      put(&out, *fmt++);
+      continue;
+    }
+    fmt = parse_spec(fmt + 1, &spec, &args);
+    switch (spec.conversion) {
+      case 'd': case 'i': {
+        long long value;
+        switch (spec.length) {
+          case 'H': value = (signed char)va_arg(args, int); break;
+          case 'h': value = (short)va_arg(args, int); break;
+          case 'l': value = va_arg(args, long); break;
+          case 'L': value = va_arg(args, long long); break;
+          case 'j': value = va_arg(args, intmax_t); break;
+          case 'z': value = (long long)va_arg(args, size_t); break;
+          case 't': value = va_arg(args, ptrdiff_t); break;
+          default: value = va_arg(args, int); break;
+        }
+        format_integer(&out, &spec, value < 0 ? -(uint64_t)value : (uint64_t)value,
+                       value < 0);
+        break;
+      }
+      case 'u': case 'o': case 'x': case 'X': {
+        uint64_t value;
+        switch (spec.length) {
+          case 'H': value = (unsigned char)va_arg(args, unsigned); break;
+          case 'h': value = (unsigned short)va_arg(args, unsigned); break;
+          case 'l': value = va_arg(args, unsigned long); break;
+          case 'L': value = va_arg(args, unsigned long long); break;
+          case 'j': value = va_arg(args, uintmax_t); break;
+          case 'z': value = va_arg(args, size_t); break;
+          case 't': value = (uint64_t)va_arg(args, ptrdiff_t); break;
+          default: value = va_arg(args, unsigned); break;
+        }
+        format_integer(&out, &spec, value, false);
+        break;
+      }
+      case 'p': {
+        spec.alternate = true;
+        spec.conversion = 'x';
+        format_integer(&out, &spec, (uintptr_t)va_arg(args, void *), false);
+        break;
+      }
+      case 'c': {
+        char c = (char)va_arg(args, int);
+        spec.precision = -1;
+        format_field(&out, &spec, "", &c, 1, 0);
+        break;
+      }
+      case 's': {
+        const char *s = va_arg(args, const char *);
+        size_t length;
+        if (s == NULL) {
+          s = "(null)";
+        }
+        if (spec.precision >= 0) {
+          const char *end = memchr(s, '\0', spec.precision);
+          length = end ? (size_t)(end - s) : (size_t)spec.precision;
+        } else {
+          length = strlen(s);
+        }
+        spec.precision = -1;
+        format_field(&out, &spec, "", s, (int)length, 0);
+        break;
+      }
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+        double value = spec.length == 'L' ? (double)va_arg(args, long double)
+                                          : va_arg(args, double);
+        format_double(&out, &spec, value);
+        break;
+      }
+      case 'n':
+        (void)va_arg(args, void *);    // not supported: ignored
+        break;
+      case '%':
+        put(&out, '%');
+        break;
+      default:
+        break;    // unknown conversion (or end of string): print nothing
+    }
+  }
+  va_end(args);
+  if (size > 0) {
+    buf[out.n < size ? out.n : size - 1] = '\0';
+  }
+  return (int)out.n;
+}
+
+int picolog_snprintf(char *buf, size_t size, const char *fmt, ...) {
+  va_list ap;
+  int n;
+  va_start(ap, fmt);
+  n = picolog_vsnprintf(buf, size, fmt, ap);
+  va_end(ap);
+  return n;
+}
+
+// =============================================================================
+// private code
+
+static void put(output_t *out, char c) {
+  if (out->n + 1 < out->size) {
+    out->buf[out->n] = c;
+  }
+  out->n++;
+}
+
+static void put_padding(output_t *out, char c, int count) {
+  while (count-- > 0) {
+    put(out, c);
+  }
+}
+
+// parse flags, width, precision and length following a '%'.  '*' values are
+// taken from ap.  Returns the character after the conversion.
+static const char *parse_spec(const char *fmt, spec_t *spec, va_list *ap) {
+  memset(spec, 0, sizeof(*spec));
+  spec->precision = -1;
+  for (;; fmt++) {
+    switch (*fmt) {
+      case '-': spec->left = true; continue;
+      case '+': spec->plus = true; continue;
+      case ' ': spec->space = true; continue;
+      case '#': spec->alternate = true; continue;
+      case '0': spec->zero = true; continue;
+    }
+    break;
+  }
+  if (*fmt == '*') {
+    spec->width = va_arg(*ap, int);
+    if (spec->width < 0) {
+      spec->left = true;
+      spec->width = -spec->width;
+    }
+    fmt++;
+  } else {
+    while (*fmt >= '0' && *fmt <= '9') {
+      spec->width = spec->width * 10 + (*fmt++ - '0');
+    }
+  }
+  if (*fmt == '.') {
+    fmt++;
+    spec->precision = 0;
+    if (*fmt == '*') {
+      spec->precision = va_arg(*ap, int);
+      fmt++;
+    } else {
+      while (*fmt >= '0' && *fmt <= '9') {
+        spec->precision = spec->precision * 10 + (*fmt++ - '0');
+      }
+    }
+  }
+  switch (*fmt) {
+    case 'h':
+      spec->length = fmt[1] == 'h' ? 'H' : 'h';
+      fmt += fmt[1] == 'h' ? 2 : 1;
+      break;
+    case 'l':
+      spec->length = fmt[1] == 'l' ? 'L' : 'l';
+      fmt += fmt[1] == 'l' ? 2 : 1;
+      break;
+    case 'L':    // long double
+      spec->length = 'L';
+      fmt++;
+      break;
+    case 'j': case 'z': case 't':
+      spec->length = *fmt++;
+      break;
+  }
+  spec->conversion = *fmt;
+  return *fmt ? fmt + 1 : fmt;
+}
+
+// write the decimal digits of value so that they end just before end,
+// returning how many there are.  Two digits at a time, and in 32 bit
+// arithmetic for all but the top of a 64 bit value.
+static int utoa_decimal(char *end, uint64_t value) {
+  char *p = end;
+  uint32_t low;
+  int chunk;
+
+  while (value > UINT32_MAX) {
+    uint64_t high = value / 100000000;
+    low = (uint32_t)(value - high * 100000000);
+    for (chunk=0; chunk<4; chunk++) {
+      p -= 2;
+      memcpy(p, &s_digit_pairs[(low % 100) * 2], 2);
+      low /= 100;
+    }
+    value = high;
+  }
+  low = (uint32_t)value;
+  while (low >= 100) {
+    p -= 2;
+    memcpy(p, &s_digit_pairs[(low % 100) * 2], 2);
+    low /= 100;
+  }
+  if (low >= 10) {
+    p -= 2;
+    memcpy(p, &s_digit_pairs[low * 2], 2);
+  } else {
+    *--p = (char)('0' + low);
+  }
+  return (int)(end - p);
+}
+
+static void format_integer(output_t *out, const spec_t *spec, uint64_t value,
+                           bool negative) {
+  static const char lower[] = "0123456789abcdef";
+  static const char upper[] = "0123456789ABCDEF";
+  char digits[DIGITS_LENGTH];
+  char *end = digits + sizeof(digits);
+  const char *prefix = "";
+  int length = 0;
+  int zeros;
+
+  switch (spec->conversion) {
+    case 'x': case 'X': {
+      const char *table = spec->conversion == 'x' ? lower : upper;
+      uint64_t v = value;
+      do {
+        digits[sizeof(digits) - ++length] = table[v & 0xF];
+        v >>= 4;
+      } while (v);
+      if (spec->alternate && value != 0) {
+        prefix = spec->conversion == 'x' ? "0x" : "0X";
+      }
+      break;
+    }
+    case 'o': {
+      uint64_t v = value;
+      do {
+        digits[sizeof(digits) - ++length] = (char)('0' + (v & 7));
+        v >>= 3;
+      } while (v);
+      if (spec->alternate && value != 0) {
+        prefix = "0";
+      }
+      break;
+    }
+    default:
+      length = utoa_decimal(end, value);
+      if (negative) {
+        prefix = "-";
+      } else if (spec->plus) {
+        prefix = "+";
+      } else if (spec->space) {
+        prefix = " ";
+      }
+      break;
+  }
+  if (spec->precision == 0 && value == 0) {
+    length = 0;    // "%.0d" of zero prints no digits
+  }
+  zeros = spec->precision > length ? spec->precision - length : 0;
+  format_field(out, spec, prefix, end - length, length, zeros);
+}
+
+// write prefix, zeros and digits, padded to the field width
+static void format_field(output_t *out, const spec_t *spec, const char *prefix,
+                         const char *digits, int length, int zeros) {
+  int prefix_length = (int)strlen(prefix);
+  int padding = spec->width - prefix_length - zeros - length;
+  int i;
+
+  if (spec->zero && !spec->left && spec->precision < 0 && spec->conversion != 's' &&
+      spec->conversion != 'c') {
+    zeros += padding > 0 ? padding : 0;    // '0' pads between sign and digits
+    padding = 0;
+  }
+  if (!spec->left) {
+    put_padding(out, ' ', padding);
+  }
+  for (i=0; i<prefix_length; i++) {
+    put(out, prefix[i]);
+  }
+  put_padding(out, '0', zeros);
+  for (i=0; i<length; i++) {
+    put(out, digits[i]);
+  }
+  if (spec->left) {
+    put_padding(out, ' ', padding);
+  }
+}
+
+// write the first MAX_SIGNIFICANT + 1 significant decimal digits of value
+// (finite and > 0) to digits, returning the decimal exponent of the first.
+// The digits are exact: the value is taken apart into its integer part and
+// its binary fraction.  A fraction of up to 60 bits is multiplied out a
+// digit at a time in 64 bits.  Otherwise the work is done nine digits at a
+// time on numbers of up to BIG_WORDS 32 bit words.  An integer part of 2^64
+// or more is divided by 10^9, and a longer fraction is multiplied by 10^9,
+// each step's carry out of its top being the next nine digits.
+static int to_decimal(double value, char *digits) {
+  union { double d; uint64_t u; } bits = { value };
+  int biased = (int)(bits.u >> 52) & 0x7FF;
+  uint64_t mantissa = bits.u & (((uint64_t)1 << 52) - 1);
+  int e = biased ? biased - 1075 : -1074;    // value is mantissa * 2^e
+  decimal_t decimal = { digits, 0, 0, 0 };
+  uint32_t big[BIG_WORDS];
+  char text[20];
+  int words, i;
+
+  if (biased) {
+    mantissa |= (uint64_t)1 << 52;
+  }
+  if (e > 11) {
+    // 2^64 or more: only the last four chunks of nine digits, which hold
+    // the 25 or more that are wanted, are kept
+    uint32_t chunks[4];
+    int count = 0;
+    int shift = e % 32;
+    words = e / 32;
+    memset(big, 0, sizeof(big));
+    big[words] = (uint32_t)(mantissa << shift);
+    big[words + 1] = (uint32_t)((mantissa << shift) >> 32);
+    big[words + 2] = shift ? (uint32_t)(mantissa >> (64 - shift)) : 0;
+    words += 3;
+    while (words > 0) {
+      uint64_t remainder = 0;
+      while (words > 0 && big[words - 1] == 0) {
+        words--;
+      }
+      for (i=words-1; i>=0; i--) {
+        uint64_t n = (remainder << 32) | big[i];
+        big[i] = (uint32_t)(n / BILLION);
+        remainder = n % BILLION;
+      }
+      chunks[count++ % 4] = (uint32_t)remainder;
+      while (words > 0 && big[words - 1] == 0) {
+        words--;
+      }
+    }
+    i = utoa_decimal(text + sizeof(text), chunks[(count - 1) % 4]);
+    decimal.position = (count - 1) * 9 + i - 1;
+    add_digits(&decimal, text + sizeof(text) - i, i);
+    for (i=count-2; i>=0 && i>=count-4; i--) {
+      add_chunk(&decimal, chunks[i % 4]);
+    }
+  } else if (e >= 0) {
+    i = utoa_decimal(text + sizeof(text), mantissa << e);
+    decimal.position = i - 1;
+    add_digits(&decimal, text + sizeof(text) - i, i);
+  } else {
+    uint64_t integer = -e < 64 ? mantissa >> -e : 0;
+    uint64_t fraction = -e < 64 ? mantissa & (((uint64_t)1 << -e) - 1) : mantissa;
+    int shift;
+    decimal.position = -1;
+    if (integer != 0) {
+      i = utoa_decimal(text + sizeof(text), integer);
+      decimal.position = i - 1;
+      add_digits(&decimal, text + sizeof(text) - i, i);
+    }
+    if (-e <= 60) {
+      // the fraction, over 2^-e, can be multiplied by 10 in 64 bits
+      while (decimal.count <= MAX_SIGNIFICANT) {
+        fraction *= 10;
+        text[0] = (char)('0' + (fraction >> -e));
+        fraction &= ((uint64_t)1 << -e) - 1;
+        add_digits(&decimal, text, 1);
+      }
+      return decimal.exponent;
+    }
+    // the fraction, over 2^-e, as a fraction over 2^(32 * words)
+    words = (-e + 31) / 32;
+    shift = words * 32 + e;
+    memset(big, 0, sizeof(big));
+    big[0] = (uint32_t)(fraction << shift);
+    big[1] = (uint32_t)((fraction << shift) >> 32);
+    big[2] = shift ? (uint32_t)(fraction >> (64 - shift)) : 0;
+    i = 0;    // the words below big[i] have become zero
+    while (decimal.count <= MAX_SIGNIFICANT && i < words) {
+      uint64_t carry = 0;
+      int j;
+      for (j=i; j<words; j++) {
+        uint64_t n = (uint64_t)big[j] * BILLION + carry;
+        big[j] = (uint32_t)n;
+        carry = n >> 32;
+      }
+      add_chunk(&decimal, (uint32_t)carry);
+      while (i < words && big[i] == 0) {
+        i++;
+      }
+    }
+  }
+  while (decimal.count <= MAX_SIGNIFICANT) {
+    digits[decimal.count++] = '0';
+  }
+  return decimal.exponent;
+}
+
+// append length digits from text to those to_decimal() is collecting,
+// leaving out leading zeros
+static void add_digits(decimal_t *decimal, const char *text, int length) {
+  int i;
+  for (i=0; i<length; i++, decimal->position--) {
+    if (decimal->count == 0) {
+      if (text[i] == '0') {
+        continue;
+      }
+      decimal->exponent = decimal->position;
+    }
+    if (decimal->count <= MAX_SIGNIFICANT) {
+      decimal->digits[decimal->count++] = text[i];
+    }
+  }
+}
+
+// append the nine digits of chunk, with its leading zeros
+static void add_chunk(decimal_t *decimal, uint32_t chunk) {
+  char text[9];
+  int i;
+  for (i=8; i>=0; i--) {
+    text[i] = (char)('0' + chunk % 10);
+    chunk /= 10;
+  }
+  add_digits(decimal, text, 9);
+}
+
+// round the digits from to_decimal() to count significant digits, halfway
+// cases away from zero, adding one to exponent if that carries into a new
+// leading digit.  Returns how many of the digits are significant: any that
+// are asked for beyond those are zeros.
+static int round_digits(char *digits, int count, int *exponent) {
+  int i;
+  if (count > MAX_SIGNIFICANT) {
+    return MAX_SIGNIFICANT;
+  } else if (count < 0) {
+    return 0;
+  }
+  if (digits[count] >= '5') {
+    for (i=count-1; i>=0 && digits[i]=='9'; i--) {
+      digits[i] = '0';
+    }
+    if (i >= 0) {
+      digits[i]++;
+    } else {
+      digits[0] = '1';    // all nines, or count 0 and a value of 5 or more
+      (*exponent)++;
+      return count > 0 ? count : 1;
+    }
+  }
+  return count;
+}
+
+// the digit at position in digits, of which length are significant
+static char digit_at(const char *digits, int length, int position) {
+  return position >= 0 && position < length ? digits[position] : '0';
+}
+
+// write the number with the given significant digits, the one at position
+// units being the units digit, in fixed point with precision decimals
+static void put_fixed(output_t *out, const char *digits, int length, int units,
+                      int precision, bool point) {
+  int i;
+  if (units < 0) {
+    put(out, '0');
+  }
+  for (i=0; i<=units; i++) {
+    put(out, digit_at(digits, length, i));
+  }
+  if (precision > 0 || point) {
+    put(out, '.');
+  }
+  for (i=1; i<=precision; i++) {
+    put(out, digit_at(digits, length, units + i));
+  }
+}
+
+static void format_double(output_t *out, const spec_t *spec, double value) {
+  char digits[MAX_SIGNIFICANT + 1];
+  char suffix[6];    // the exponent of %e, e.g. "e+308"
+  const char *prefix = "";
+  char conversion = spec->conversion;
+  bool upper = conversion == 'F' || conversion == 'E' || conversion == 'G' ||
+               conversion == 'A';
+  int precision = spec->precision < 0 ? 6 : spec->precision;
+  int exponent = 0;
+  int length = 0;    // significant digits; the rest are zeros
+  int suffix_length = 0;
+  int units;         // position in digits of the units digit
+  int padding;
+  int i;
+  output_t counted = { NULL, 0, 0 };    // counts the digits without storing them
+  spec_t field = *spec;
+
+  if (value < 0 || (value == 0 && 1 / value < 0)) {
+    prefix = "-";
+    value = -value;
+  } else if (spec->plus) {
+    prefix = "+";
+  } else if (spec->space) {
+    prefix = " ";
+  }
+  if (value != value || value > 1.7976931348623157e308) {
+    field.precision = -1;
+    field.zero = false;
+    format_field(out, &field, prefix, value != value ? (upper ? "NAN" : "nan")
+                                                     : (upper ? "INF" : "inf"), 3, 0);
+    return;
+  }
+  if (value != 0) {
+    exponent = to_decimal(value, digits);
+  }
+
+  if (conversion == 'a' || conversion == 'A') {
+    conversion = 'e';
+  }
+  if (conversion == 'g' || conversion == 'G') {
+    // round to the precision in significant digits first: that decides the
+    // exponent, and with it the form
+    int significant = precision == 0 ? 1 : precision;
+    if (value != 0) {
+      length = round_digits(digits, significant, &exponent);
+    }
+    if (exponent < -4 || exponent >= significant) {
+      conversion = 'e';
+      precision = significant - 1;
+    } else {
+      conversion = 'f';
+      precision = significant - 1 - exponent;
+    }
+    if (!spec->alternate) {
+      // trailing zeros are dropped
+      int last = conversion == 'e' ? precision : exponent + precision;
+      while (precision > 0 && digit_at(digits, length, last) == '0') {
+        precision--;
+        last--;
+      }
+    }
+  } else if (value != 0) {
+    bool fixed = conversion == 'f' || conversion == 'F';
+    length = round_digits(digits, fixed ? exponent + 1 + precision : precision + 1,
+                          &exponent);
+  }
+
+  if (conversion == 'e' || conversion == 'E') {
+    int magnitude = exponent < 0 ? -exponent : exponent;
+    suffix[suffix_length++] = upper ? 'E' : 'e';
+    suffix[suffix_length++] = exponent < 0 ? '-' : '+';
+    if (magnitude >= 100) {
+      suffix[suffix_length++] = (char)('0' + magnitude / 100);
+    }
+    suffix[suffix_length++] = (char)('0' + magnitude / 10 % 10);
+    suffix[suffix_length++] = (char)('0' + magnitude % 10);
+    units = 0;
+  } else {
+    units = exponent;
+  }
+
+  put_fixed(&counted, digits, length, units, precision, spec->alternate);
+  padding = spec->width - (int)strlen(prefix) - (int)counted.n - suffix_length;
+  if (!spec->left && !spec->zero) {
+    put_padding(out, ' ', padding);
+  }
+  while (*prefix) {
+    put(out, *prefix++);
+  }
+  if (!spec->left && spec->zero) {
+    put_padding(out, '0', padding);    // '0' pads between sign and digits
+  }
+  put_fixed(out, digits, length, units, precision, spec->alternate);
+  for (i=0; i<suffix_length; i++) {
+    put(out, suffix[i]);
+  }
+  if (spec->left) {
+    put_padding(out, ' ', padding);
+  }
+}
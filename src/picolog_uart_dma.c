@@ -0,0 +1,140 @@
+/**
+ * \file picolog_uart_dma.c
+ *
+ * \brief picolog subscriber that writes to a UART using DMA
+ *
+ * See picolog_uart_dma.h.
+ */
+
+#include "picolog_uart_dma.h"
+
+#include <string.h>
+
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+
+// =============================================================================
+// local storage
+
+static uart_inst_t *s_uart;
+static int s_channel = -1;
+static spin_lock_t *s_lock;       // guards the fields below
+static char s_buffers[2][PICOLOG_UART_DMA_BUFFER_LENGTH];
+static int s_filling;             // index of the buffer being filled
+static size_t s_fill;             // bytes waiting in s_buffers[s_filling]
+static bool s_busy;               // a transfer is in flight
+static uint32_t s_dropped;
+
+// =============================================================================
+// forward declarations
+
+static void append(const void *data, size_t length);
+static void start_transfer(void);
+static void dma_irq_handler(void);
+
+// =============================================================================
+// user-visible code
+
+// take over a DMA channel for writes to uart, which must already be set up
+// with uart_init() and have its TX pin assigned.
+void picolog_uart_dma_init(uart_inst_t *uart) {
+  dma_channel_config config;
+
+  if (s_channel >= 0) {
+    return;
+  }
+  s_uart = uart;
+  s_lock = spin_lock_instance(spin_lock_claim_unused(true));
+  s_channel = dma_claim_unused_channel(true);
+  config = dma_channel_get_default_config(s_channel);
+  channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+  channel_config_set_read_increment(&config, true);
+  channel_config_set_write_increment(&config, false);
+  channel_config_set_dreq(&config, uart_get_dreq(uart, true));
+  dma_channel_configure(s_channel, &config, &uart_get_hw(uart)->dr, NULL, 0, false);
+  dma_channel_set_irq0_enabled(s_channel, true);
+  irq_add_shared_handler(DMA_IRQ_0, dma_irq_handler,
+                         PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+  irq_set_enabled(DMA_IRQ_0, true);
+}
+
+// the subscriber: queue the formatted line for the next DMA transfer
+void picolog_uart_dma(picolog_level_t severity, char *msg) {
+  char line[PICOLOG_MAX_MESSAGE_LENGTH + 32];
+  size_t length;
+
+  if (s_channel < 0) {
+    return;
+  }
+  // format outside the lock, which is only needed to append the line
+  length = picolog_format_line(line, sizeof(line), severity, msg);
+  append(line, length);
+}
+
+// the binary subscriber: queue the frame for the next DMA transfer
+void picolog_uart_dma_binary(picolog_level_t severity, const uint8_t *frame,
+                             size_t length) {
+  if (s_channel < 0) {
+    return;
+  }
+  append(frame, length);
+}
+
+// true while there is output still to be sent, e.g. before going to sleep
+bool picolog_uart_dma_busy(void) {
+  return s_busy || s_fill > 0;
+}
+
+// number of messages dropped because both buffers were full
+uint32_t picolog_uart_dma_dropped(void) {
+  return s_dropped;
+}
+
+// =============================================================================
+// private code
+
+// copy data into the buffer being filled, sending it straight away if the
+// DMA is idle.  data is dropped rather than split if it doesn't fit.
+static void append(const void *data, size_t length) {
+  uint32_t save = spin_lock_blocking(s_lock);
+  if (s_fill + length > PICOLOG_UART_DMA_BUFFER_LENGTH && !s_busy) {
+    start_transfer();
+  }
+  if (s_fill + length > PICOLOG_UART_DMA_BUFFER_LENGTH) {
+    s_dropped++;
+  } else {
+    memcpy(&s_buffers[s_filling][s_fill], data, length);
+    s_fill += length;
+    if (!s_busy) {
+      start_transfer();
+    }
+  }
+  spin_unlock(s_lock, save);
+}
+
+// send the buffer being filled and start filling the other one.  Called with
+// s_lock held and no transfer in flight.
+static void start_transfer(void) {
+  if (s_fill == 0) {
+    return;
+  }
+  s_busy = true;
+  dma_channel_transfer_from_buffer_now(s_channel, s_buffers[s_filling], s_fill);
+  s_filling ^= 1;
+  s_fill = 0;
+}
+
+// a transfer has finished: send whatever was coalesced in the meantime
+static void dma_irq_handler(void) {
+  uint32_t save;
+
+  if (!dma_channel_get_irq0_status(s_channel)) {
+    return;    // another channel sharing DMA_IRQ_0
+  }
+  dma_channel_acknowledge_irq0(s_channel);
+  save = spin_lock_blocking(s_lock);
+  s_busy = false;
+  start_transfer();
+  spin_unlock(s_lock, save);
+}
@@ -0,0 +1,51 @@
+/**
+ * \file picolog_uart_dma.h
+ *
+ * \brief picolog subscriber that writes to a UART using DMA
+ *
+ * picolog_format() prints with printf, which busy-waits on the UART FIFO for
+ * as long as the line takes to send.  This subscriber instead formats each
+ * message into one of two buffers and sends it with a DMA transfer into the
+ * UART TX FIFO, so the subscriber returns straight away.  Messages that
+ * arrive while a transfer is in flight are coalesced into the other buffer
+ * and go out together in the next transfer:
+ *
+ *     uart_init(uart0, 115200);
+ *     gpio_set_function(0, GPIO_FUNC_UART);
+ *     picolog_uart_dma_init(uart0);
+ *     PICOLOG_SUBSCRIBE(picolog_uart_dma, PICOLOG_DEBUG_LEVEL);
+ *
+ * For the binary wire format subscribe picolog_uart_dma_binary with
+ * PICOLOG_SUBSCRIBE_BINARY() instead.
+ *
+ * The UART should not also be used for stdio, or printf output and log lines
+ * will be interleaved.  If both buffers are full the message is dropped.
+ */
+
+#ifndef PICOLOG_UART_DMA_H_
+#define PICOLOG_UART_DMA_H_
+
+#include "picolog.h"
+#include "hardware/uart.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// size of each of the two output buffers
+#ifndef PICOLOG_UART_DMA_BUFFER_LENGTH
+#define PICOLOG_UART_DMA_BUFFER_LENGTH 512
+#endif
+
+void picolog_uart_dma_init(uart_inst_t *uart);
+void picolog_uart_dma(picolog_level_t severity, char *msg);
+void picolog_uart_dma_binary(picolog_level_t severity, const uint8_t *frame,
+                             size_t length);
+bool picolog_uart_dma_busy(void);
+uint32_t picolog_uart_dma_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOLOG_UART_DMA_H_ */
@@ -0,0 +1,210 @@
+/**
+ * \file picolog_udp.c
+ *
+ * \brief picolog subscriber that sends messages over UDP with lwIP (Pico W)
+ *
+ * See picolog_udp.h.
+ */
+
+#include "picolog_udp.h"
+
+#include <string.h>
+
+#include "pico/async_context.h"
+#include "pico/cyw43_arch.h"
+#include "pico/time.h"
+#include "hardware/sync.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+
+// =============================================================================
+// types and definitions
+
+typedef struct {
+  uint16_t length;      // bytes of frames in data
+  uint16_t messages;    // number of frames, for counting them if lost
+  uint8_t data[PICOLOG_UDP_DATAGRAM_SIZE];
+} datagram_t;
+
+// =============================================================================
+// local storage
+
+// the datagrams form a ring between the subscriber, which fills them, and
+// the worker, which sends them.  While s_open, the datagram at s_filled is
+// being filled, across as many batches as it takes; the subscriber, the
+// timer and picolog_udp_flush() may each hand it to the worker, so s_lock
+// guards it and the fields that describe it.  s_sent is only written by the
+// worker.
+static datagram_t s_datagrams[PICOLOG_UDP_DATAGRAMS];
+static uint32_t s_filled;     // datagrams handed to the worker
+static uint32_t s_sent;       // datagrams the worker is done with
+static bool s_open;           // the datagram at s_filled holds frames
+static uint64_t s_opened;     // time_us_64() when its first frame went in
+static uint32_t s_dropped;    // messages with no datagram to go in
+static uint32_t s_lost;       // messages in datagrams lwIP couldn't send (worker)
+static spin_lock_t *s_lock;
+
+static struct udp_pcb *s_pcb;
+static ip_addr_t s_host;
+static uint16_t s_port;
+static async_context_t *s_context;
+
+// =============================================================================
+// forward declarations
+
+static void add_frame(const uint8_t *frame, size_t length);
+static void publish(void);
+static void send_pending(async_context_t *context, async_when_pending_worker_t *worker);
+static void send_aged(async_context_t *context, async_at_time_worker_t *timer);
+
+static async_when_pending_worker_t s_worker = { .do_work = send_pending };
+static async_at_time_worker_t s_timer = { .do_work = send_aged };
+
+// =============================================================================
+// user-visible code
+
+// send messages to port on host.  Returns false if lwIP has no memory for
+// the connection.  s_pcb is set last, since the subscriber takes it being
+// set to mean everything else is ready; once it is, calling this again
+// does nothing.
+bool picolog_udp_init(const ip_addr_t *host, uint16_t port) {
+  struct udp_pcb *pcb;
+  if (__atomic_load_n(&s_pcb, __ATOMIC_ACQUIRE) != NULL) {
+    return true;
+  }
+  cyw43_arch_lwip_begin();
+  pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+  cyw43_arch_lwip_end();
+  if (pcb == NULL) {
+    return false;
+  }
+  if (s_lock == NULL) {
+    s_lock = spin_lock_instance(spin_lock_claim_unused(true));
+  }
+  ip_addr_copy(s_host, *host);
+  s_port = port;
+  s_context = cyw43_arch_async_context();
+  async_context_add_when_pending_worker(s_context, &s_worker);
+  async_context_add_at_time_worker_at(s_context, &s_timer,
+                                      make_timeout_time_us(PICOLOG_UDP_MAX_AGE_US));
+  __atomic_store_n(&s_pcb, pcb, __ATOMIC_RELEASE);
+  return true;
+}
+
+// the batch subscriber: encode each record and add it to the open datagram
+void picolog_udp_batch(const picolog_record_t *records, size_t count) {
+  uint8_t frame[PICOLOG_MAX_FRAME_LENGTH];
+  size_t i;
+
+  if (__atomic_load_n(&s_pcb, __ATOMIC_ACQUIRE) == NULL) {
+    return;
+  }
+  for (i=0; i<count; i++) {
+    size_t length = picolog_encode_frame(frame, &records[i]);
+    uint32_t save = spin_lock_blocking(s_lock);
+    add_frame(frame, length);
+    spin_unlock(s_lock, save);
+  }
+}
+
+// send the frames added so far without waiting for the datagram to fill or
+// for PICOLOG_UDP_MAX_AGE_US to pass, e.g. just after picolog_flush() before
+// going to sleep.  It may be called from any context.
+void picolog_udp_flush(void) {
+  uint32_t save;
+  if (__atomic_load_n(&s_pcb, __ATOMIC_ACQUIRE) == NULL) {
+    return;
+  }
+  save = spin_lock_blocking(s_lock);
+  if (s_open) {
+    publish();
+  }
+  spin_unlock(s_lock, save);
+}
+
+// number of messages lost so far, for want of a buffer or because lwIP
+// failed to send them
+uint32_t picolog_udp_dropped(void) {
+  return s_dropped + __atomic_load_n(&s_lost, __ATOMIC_RELAXED);
+}
+
+// =============================================================================
+// private code
+
+// add a frame to the open datagram, first handing that to the worker if
+// the frame won't fit, or opening the next one if none is open.  If every
+// datagram is waiting to be sent, the frame is dropped.  s_lock must be
+// held.
+static void add_frame(const uint8_t *frame, size_t length) {
+  datagram_t *datagram = &s_datagrams[s_filled % PICOLOG_UDP_DATAGRAMS];
+  if (s_open && datagram->length + length > PICOLOG_UDP_DATAGRAM_SIZE) {
+    publish();
+    datagram = &s_datagrams[s_filled % PICOLOG_UDP_DATAGRAMS];
+  }
+  if (!s_open) {
+    if (s_filled - __atomic_load_n(&s_sent, __ATOMIC_ACQUIRE) == PICOLOG_UDP_DATAGRAMS) {
+      s_dropped++;
+      return;
+    }
+    datagram->length = 0;
+    datagram->messages = 0;
+    s_open = true;
+    s_opened = time_us_64();
+  }
+  memcpy(&datagram->data[datagram->length], frame, length);
+  datagram->length += length;
+  datagram->messages++;
+}
+
+// hand the open datagram to the worker.  s_lock must be held;
+// async_context_set_work_pending() may be called with interrupts disabled.
+static void publish(void) {
+  s_open = false;
+  __atomic_store_n(&s_filled, s_filled + 1, __ATOMIC_RELEASE);
+  async_context_set_work_pending(s_context, &s_worker);
+}
+
+// the worker, run by the async_context in lwIP's context: send every
+// datagram waiting.  The pbuf refers to the datagram's buffer, and lwIP
+// chains its own headers in front of it; anything it has to queue rather
+// than send at once it copies, so the buffer is free again as soon as
+// udp_sendto() returns.
+static void send_pending(async_context_t *context, async_when_pending_worker_t *worker) {
+  uint32_t filled = __atomic_load_n(&s_filled, __ATOMIC_ACQUIRE);
+  (void)context;
+  (void)worker;
+
+  while (s_sent != filled) {
+    datagram_t *datagram = &s_datagrams[s_sent % PICOLOG_UDP_DATAGRAMS];
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, datagram->length, PBUF_REF);
+    err_t err = ERR_MEM;
+    if (p != NULL) {
+      p->payload = datagram->data;
+      err = udp_sendto(s_pcb, p, &s_host, s_port);
+      pbuf_free(p);
+    }
+    if (err != ERR_OK) {
+      __atomic_store_n(&s_lost, s_lost + datagram->messages, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&s_sent, s_sent + 1, __ATOMIC_RELEASE);
+  }
+}
+
+// the timer, run by the async_context: hand the open datagram to the worker
+// once it is PICOLOG_UDP_MAX_AGE_US old, and come back when the next one
+// could be.  An at-time worker is removed before it runs, so it adds itself
+// again each time.
+static void send_aged(async_context_t *context, async_at_time_worker_t *timer) {
+  uint64_t now = time_us_64();
+  uint64_t due = now + PICOLOG_UDP_MAX_AGE_US;
+  uint32_t save = spin_lock_blocking(s_lock);
+  if (s_open) {
+    if (now - s_opened >= PICOLOG_UDP_MAX_AGE_US) {
+      publish();
+    } else {
+      due = s_opened + PICOLOG_UDP_MAX_AGE_US;
+    }
+  }
+  spin_unlock(s_lock, save);
+  async_context_add_at_time_worker_at(context, timer, from_us_since_boot(due));
+}
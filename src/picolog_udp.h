@@ -0,0 +1,68 @@
+/**
+ * \file picolog_udp.h
+ *
+ * \brief picolog subscriber that sends messages over UDP with lwIP (Pico W)
+ *
+ * A batch subscriber that packs the binary frames of many messages (see
+ * picolog_binary_function_t) into each UDP datagram, so a fleet of boards
+ * can ship their logs to a collector that runs tools/picolog_decode.py:
+ *
+ *     ip_addr_t collector;
+ *     ipaddr_aton("192.168.1.10", &collector);
+ *     picolog_udp_init(&collector, 5140);
+ *     PICOLOG_SUBSCRIBE_BATCH(picolog_udp_batch, PICOLOG_INFO_LEVEL);
+ *
+ * and on the collector, e.g. `socat -u UDP-RECV:5140 - | picolog_decode.py
+ * firmware.elf`.
+ *
+ * Memory is bounded: frames are written into one of PICOLOG_UDP_DATAGRAMS
+ * buffers of PICOLOG_UDP_DATAGRAM_SIZE bytes, and a datagram stays open
+ * across the batches the drain delivers (so use it with PICOLOG_DEFERRED)
+ * until the next frame won't fit, it has been open for
+ * PICOLOG_UDP_MAX_AGE_US, or picolog_udp_flush() is called.  A datagram
+ * then carries a packet's worth of messages however few each batch holds.
+ * The datagrams are sent later from lwIP's own context, by an async_context
+ * worker, with a pbuf that refers to the buffer rather than copying it.  If
+ * every buffer is still waiting to be sent, or lwIP can't send one, its
+ * messages are dropped and counted by picolog_udp_dropped() rather than
+ * holding up the caller.
+ *
+ * The application must link one of the pico_cyw43_arch_lwip_* libraries
+ * and have brought the network up before messages are delivered.
+ */
+
+#ifndef PICOLOG_UDP_H_
+#define PICOLOG_UDP_H_
+
+#include "picolog.h"
+#include "lwip/ip_addr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// size of one datagram's payload: a little under the 1472 bytes that fit an
+// Ethernet or Wi-Fi frame unfragmented
+#ifndef PICOLOG_UDP_DATAGRAM_SIZE
+#define PICOLOG_UDP_DATAGRAM_SIZE 1024
+#endif
+// number of datagrams that may wait to be sent
+#ifndef PICOLOG_UDP_DATAGRAMS
+#define PICOLOG_UDP_DATAGRAMS 4
+#endif
+// longest a message may wait in a datagram that isn't full.  A timer in the
+// async_context checks this often even when nothing is logged.
+#ifndef PICOLOG_UDP_MAX_AGE_US
+#define PICOLOG_UDP_MAX_AGE_US 100000
+#endif
+
+bool picolog_udp_init(const ip_addr_t *host, uint16_t port);
+void picolog_udp_batch(const picolog_record_t *records, size_t count);
+void picolog_udp_flush(void);
+uint32_t picolog_udp_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOLOG_UDP_H_ */
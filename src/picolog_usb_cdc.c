@@ -0,0 +1,49 @@
+/**
+ * \file picolog_usb_cdc.c
+ *
+ * \brief picolog subscriber that writes to the TinyUSB CDC endpoint
+ *
+ * See picolog_usb_cdc.h.
+ */
+
+#include "picolog_usb_cdc.h"
+
+#include "tusb.h"
+
+// =============================================================================
+// local storage
+
+static uint32_t s_dropped;
+
+// =============================================================================
+// user-visible code
+
+// the subscriber: queue the formatted line in the CDC transmit FIFO
+void picolog_usb_cdc(picolog_level_t severity, char *msg) {
+  char line[PICOLOG_MAX_MESSAGE_LENGTH + 32];
+  size_t length;
+
+  length = picolog_format_line(line, sizeof(line), severity, msg);
+  if (!tud_cdc_connected() || tud_cdc_write_available() < length) {
+    s_dropped++;
+    return;
+  }
+  tud_cdc_write(line, length);
+  tud_cdc_write_flush();
+}
+
+// the binary subscriber: queue the frame in the CDC transmit FIFO
+void picolog_usb_cdc_binary(picolog_level_t severity, const uint8_t *frame,
+                            size_t length) {
+  if (!tud_cdc_connected() || tud_cdc_write_available() < length) {
+    s_dropped++;
+    return;
+  }
+  tud_cdc_write(frame, length);
+  tud_cdc_write_flush();
+}
+
+// number of messages dropped because no host was connected or the FIFO was full
+uint32_t picolog_usb_cdc_dropped(void) {
+  return s_dropped;
+}
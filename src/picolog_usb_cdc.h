@@ -0,0 +1,40 @@
+/**
+ * \file picolog_usb_cdc.h
+ *
+ * \brief picolog subscriber that writes to the TinyUSB CDC endpoint
+ *
+ * Rather than going through printf and stdio, this subscriber hands each
+ * formatted line straight to TinyUSB's CDC transmit FIFO and returns.  Lines
+ * queued while the endpoint is busy are coalesced by the FIFO into a single
+ * USB packet.  If no host is connected, or the FIFO has no room for the whole
+ * line, the message is dropped rather than waiting:
+ *
+ *     PICOLOG_SUBSCRIBE(picolog_usb_cdc, PICOLOG_DEBUG_LEVEL);
+ *
+ * or, for the binary wire format:
+ *
+ *     PICOLOG_SUBSCRIBE_BINARY(picolog_usb_cdc_binary, PICOLOG_DEBUG_LEVEL);
+ *
+ * TinyUSB is not thread safe, so messages must be delivered on the core that
+ * runs tud_task(), e.g. by calling PICOLOG_FLUSH() from the same loop.
+ */
+
+#ifndef PICOLOG_USB_CDC_H_
+#define PICOLOG_USB_CDC_H_
+
+#include "picolog.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void picolog_usb_cdc(picolog_level_t severity, char *msg);
+void picolog_usb_cdc_binary(picolog_level_t severity, const uint8_t *frame,
+                            size_t length);
+uint32_t picolog_usb_cdc_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOLOG_USB_CDC_H_ */
@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+"""Decompress picolog archive blocks back into text.
+
+The archive subscriber (see src/picolog_archive.h) writes messages as
+compressed blocks, each starting with the magic "PLGA".  This tool finds the
+blocks in a flash dump or an uploaded file, skipping anything between them
+such as erased flash, and rebuilds each message with the format strings from
+the firmware's ELF file:
+
+    picolog_archive.py firmware.elf flash.bin
+    cat uploads/*.bin | picolog_archive.py firmware.elf
+
+Only the Python standard library is needed, along with picolog_decode.py
+from the same directory.
+"""
+
+import argparse
+import struct
+import sys
+
+from picolog_decode import Elf, LEVELS, STRUCTURED, render, render_fields
+
+MAGIC = b"PLGA"
+HEADER = struct.Struct("<4sBBHHHIQ")
+FLAG_COMPRESSED = 0x01
+
+
+def lz4_decompress(data, size):
+    """Decompress an LZ4 block that holds size bytes."""
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        token = data[i]
+        i += 1
+        length = token >> 4
+        if length == 15:
+            while True:
+                length += data[i]
+                i += 1
+                if data[i - 1] != 255:
+                    break
+        out += data[i:i + length]
+        i += length
+        if i >= len(data):
+            break    # the last sequence has no match
+        offset = data[i] | data[i + 1] << 8
+        i += 2
+        if offset == 0 or offset > len(out):
+            raise ValueError("bad match offset")
+        length = token & 15
+        if length == 15:
+            while True:
+                length += data[i]
+                i += 1
+                if data[i - 1] != 255:
+                    break
+        for _ in range(length + 4):
+            out.append(out[-offset])    # byte by byte, as matches may overlap
+    if len(out) != size:
+        raise ValueError("block decompressed to %d bytes, not %d" % (len(out), size))
+    return bytes(out)
+
+
+def varint(data, offset):
+    value = shift = 0
+    while True:
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, offset
+
+
+def blocks(data):
+    """Yield the header fields and uncompressed messages of each block."""
+    start = data.find(MAGIC)
+    while start >= 0:
+        try:
+            (_, flags, _, count, raw_length, length,
+             sequence, base) = HEADER.unpack_from(data, start)
+            payload = data[start + HEADER.size:start + HEADER.size + length]
+            if len(payload) != length:
+                raise ValueError("block is cut short")
+            if flags & FLAG_COMPRESSED:
+                raw = lz4_decompress(payload, raw_length)
+            elif length == raw_length:
+                raw = payload
+            else:
+                raise ValueError("bad lengths")
+        except (ValueError, IndexError, struct.error) as e:
+            print("<undecodable block at %d: %s>" % (start, e), file=sys.stderr)
+            start = data.find(MAGIC, start + 1)
+            continue
+        yield count, sequence, base, raw
+        start = data.find(MAGIC, start + HEADER.size + length)
+
+
+def messages(elf, raw, base):
+    """Yield the timestamp, level name and text of each message in raw."""
+    offset = 0
+    timestamp = base
+    while offset < len(raw):
+        level = raw[offset]
+        delta, offset = varint(raw, offset + 1)
+        address, length = struct.unpack_from("<IB", raw, offset)
+        offset += 5
+        args = raw[offset:offset + length]
+        offset += length
+        timestamp += delta
+        fmt = elf.string(address)
+        structured = level & STRUCTURED
+        level &= ~STRUCTURED
+        name = LEVELS[level] if level < len(LEVELS) else "UNKNOWN"
+        if fmt is None:
+            text = "<no string at 0x%08x>" % address
+        elif structured:
+            text = render_fields(elf, fmt, args)
+        else:
+            text = render(fmt, args)
+        yield timestamp, name, text
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("elf", help="firmware ELF file the archive came from")
+    parser.add_argument("input", nargs="?", help="archive file (default: stdin)")
+    options = parser.parse_args()
+
+    elf = Elf(options.elf)
+    if options.input:
+        with open(options.input, "rb") as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+    for count, sequence, base, raw in blocks(data):
+        try:
+            for timestamp, name, text in messages(elf, raw, base):
+                print("%12.6f [%s] %s" % (timestamp / 1e6, name, text))
+        except (IndexError, struct.error):
+            print("<block of %d messages from #%d is corrupt>" % (count, sequence),
+                  file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,239 @@
+#!/usr/bin/env python3
+"""Decode picolog binary frames back into text.
+
+Binary subscribers (see picolog_binary_function_t in src/picolog.h) are given
+frames that hold the address of the format string rather than the string
+itself.  This tool reads the strings from the firmware's ELF file and
+rebuilds each message:
+
+    picolog_decode.py firmware.elf capture.bin
+    picolog_decode.py firmware.elf /dev/ttyACM0
+    cat capture.bin | picolog_decode.py firmware.elf
+
+Only the Python standard library is needed.  Argument sizes are those of the
+RP2040 (32 bit ARM EABI).
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+LEVELS = ["TRACE", "DEBUG", "INFO", "WARNING", "ERROR", "CRITICAL", "ALWAYS"]
+
+SHF_ALLOC = 0x2
+SHT_NOBITS = 8
+
+# sizes of the C types used for each length modifier on the RP2040
+INT_SIZES = {"": 4, "hh": 4, "h": 4, "l": 4, "ll": 8, "j": 8, "z": 4, "t": 4}
+POINTER_SIZE = 4
+
+CONVERSION = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d*))?(hh|h|ll|l|j|z|t|L)?([diouxXcsfFeEgGaApn%])")
+
+
+class Elf:
+    """The loadable sections of an ELF file, searchable by address."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        if self.data[:4] != b"\x7fELF":
+            raise ValueError("%s is not an ELF file" % path)
+        is64 = self.data[4] == 2
+        endian = "<" if self.data[5] == 1 else ">"
+        if is64:
+            shoff, = struct.unpack_from(endian + "Q", self.data, 0x28)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x3A)
+            header = endian + "IIQQQQ"
+        else:
+            shoff, = struct.unpack_from(endian + "I", self.data, 0x20)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x2E)
+            header = endian + "IIIIII"
+        self.sections = []
+        for i in range(shnum):
+            _, kind, flags, addr, offset, size = struct.unpack_from(
+                header, self.data, shoff + i * shentsize)
+            if flags & SHF_ALLOC and kind != SHT_NOBITS and size:
+                self.sections.append((addr, offset, size))
+
+    def string(self, address):
+        for addr, offset, size in self.sections:
+            if addr <= address < addr + size:
+                start = offset + address - addr
+                end = self.data.index(b"\0", start, offset + size)
+                return self.data[start:end].decode("utf-8", "replace")
+        return None
+
+
+def cobs_decode(frame):
+    out = bytearray()
+    i = 0
+    while i < len(frame):
+        code = frame[i]
+        if code == 0 or i + code > len(frame):
+            raise ValueError("bad COBS block")
+        out += frame[i + 1:i + code]
+        i += code
+        if code != 0xFF and i < len(frame):
+            out.append(0)
+    return bytes(out)
+
+
+class Args:
+    """Reads packed arguments the way render_args() in picolog.c does."""
+
+    def __init__(self, data):
+        self.data = data
+        self.offset = 0
+
+    def take(self, fmt, size):
+        if self.offset + size > len(self.data):
+            raise IndexError
+        value, = struct.unpack_from("<" + fmt, self.data, self.offset)
+        self.offset += size
+        return value
+
+    def integer(self, size, signed):
+        return self.take({4: "i", 8: "q"}[size] if signed else {4: "I", 8: "Q"}[size], size)
+
+    def string(self):
+        end = self.data.index(b"\0", self.offset)
+        value = self.data[self.offset:end].decode("utf-8", "replace")
+        self.offset = end + 1
+        return value
+
+
+def render(fmt, data):
+    """Format fmt with the arguments packed in data."""
+    args = Args(data)
+    out = []
+    pos = 0
+    for m in CONVERSION.finditer(fmt):
+        out.append(fmt[pos:m.start()])
+        pos = m.end()
+        flags, width, precision, modifier, conversion = m.groups()
+        modifier = modifier or ""
+        if conversion == "%":
+            out.append("%")
+            continue
+        try:
+            if width == "*":
+                width = args.integer(4, True)
+                if width < 0:
+                    flags, width = flags + "-", -width
+            if precision == "*":
+                precision = args.integer(4, True)
+                precision = None if precision < 0 else precision
+            spec = "%" + flags + (str(width) if width is not None else "")
+            if precision is not None:
+                spec += "." + str(precision)
+            if conversion in "di":
+                out.append((spec + "d") % args.integer(INT_SIZES[modifier], True))
+            elif conversion in "ouxX":
+                value = args.integer(INT_SIZES[modifier], False)
+                out.append((spec + ("d" if conversion == "u" else conversion)) % value)
+            elif conversion == "c":
+                out.append((spec + "c") % chr(args.integer(4, True) & 0xFF))
+            elif conversion in "fFeEgG":
+                out.append((spec + conversion) % args.take("d", 8))
+            elif conversion in "aA":
+                value = args.take("d", 8).hex()
+                out.append(value.upper() if conversion == "A" else value)
+            elif conversion == "p":
+                out.append((spec + "s") % hex(args.integer(POINTER_SIZE, False)))
+            elif conversion == "s":
+                out.append((spec + "s") % args.string())
+        except (IndexError, ValueError):
+            return "".join(out)    # arguments were truncated on the device
+    out.append(fmt[pos:])
+    return "".join(out)
+
+
+# structured messages (PICOLOG_KV) set the top bit of the level byte, and
+# their arguments are fields: a type byte, the key's address and the value
+STRUCTURED = 0x80
+FIELD_I32, FIELD_U32, FIELD_I64, FIELD_FLOAT, FIELD_BOOL, FIELD_STR = range(1, 7)
+
+
+def render_fields(elf, event, data):
+    """Render the fields packed in data as "event key=value ..."."""
+    args = Args(data)
+    out = [event]
+    try:
+        while args.offset < len(data):
+            kind = args.take("B", 1)
+            key = elf.string(args.integer(POINTER_SIZE, False)) or "?"
+            if kind == FIELD_I32:
+                value = str(args.integer(4, True))
+            elif kind == FIELD_U32:
+                value = str(args.integer(4, False))
+            elif kind == FIELD_I64:
+                value = str(args.integer(8, True))
+            elif kind == FIELD_FLOAT:
+                value = "%g" % args.take("f", 4)
+            elif kind == FIELD_BOOL:
+                value = "true" if args.take("B", 1) else "false"
+            elif kind == FIELD_STR:
+                value = args.string()
+            else:
+                break
+            out.append("%s=%s" % (key, value))
+    except (IndexError, ValueError):
+        pass    # fields were truncated on the device
+    return " ".join(out)
+
+
+def frames(stream):
+    buffer = b""
+    while True:
+        chunk = stream.read1(4096) if hasattr(stream, "read1") else stream.read(4096)
+        if not chunk:
+            return
+        buffer += chunk
+        *complete, buffer = buffer.split(b"\0")
+        for frame in complete:
+            if frame:
+                yield frame
+
+
+def decode(elf, frame):
+    raw = cobs_decode(frame)
+    if len(raw) < 9:
+        raise ValueError("short frame")
+    level, address, timestamp = struct.unpack_from("<BII", raw, 0)
+    fmt = elf.string(address)
+    if fmt is None:
+        raise ValueError("no string at 0x%08x" % address)
+    structured = level & STRUCTURED
+    level &= ~STRUCTURED
+    name = LEVELS[level] if level < len(LEVELS) else "UNKNOWN"
+    if structured:
+        return timestamp, name, render_fields(elf, fmt, raw[9:])
+    return timestamp, name, render(fmt, raw[9:])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("elf", help="firmware ELF file the frames came from")
+    parser.add_argument("input", nargs="?", help="capture file or serial device (default: stdin)")
+    options = parser.parse_args()
+
+    elf = Elf(options.elf)
+    stream = open(options.input, "rb", buffering=0) if options.input else sys.stdin.buffer
+    epoch = 0
+    last = None
+    for frame in frames(stream):
+        try:
+            timestamp, name, text = decode(elf, frame)
+        except ValueError as e:
+            print("<undecodable frame: %s>" % e, file=sys.stderr)
+            continue
+        # timestamps are the low 32 bits of the microsecond clock
+        if last is not None and timestamp < last:
+            epoch += 1 << 32
+        last = timestamp
+        print("%12.6f [%s] %s" % ((epoch + timestamp) / 1e6, name, text), flush=True)
+
+
+if __name__ == "__main__":
+    main()